@@ -8,6 +8,7 @@
 #include <arpa/inet.h>
 #include <pthread.h>
 #include <string.h>
+#include <stdint.h>
 #include <fcntl.h>
 #include <sys/mman.h>
 
@@ -20,12 +21,41 @@ static int page_size;
 static unsigned long len;
 static char * mmap_addr;
 
-/* Struct to be send over socket */
+/* Struct to be send over socket, fixed width so both sides agree on the layout */
 struct init_info {
-    char * mmap_addr;
-    unsigned long len;
+    uint64_t mmap_addr;
+    uint64_t len;
 };
 
+/* Retry backoff while the other process isn't listening yet, in us */
+#define BACKOFF_MIN_US 1000
+#define BACKOFF_MAX_US 64000
+
+
+/*
+ * Connect to address, retrying while the other process isn't up yet.
+ * The wait between tries starts at BACKOFF_MIN_US and doubles up to
+ * BACKOFF_MAX_US, so we connect within a few ms of the other side
+ * starting to listen.
+ */
+static int connect_backoff(struct sockaddr_in * address) {
+    int sock;
+    int backoff = BACKOFF_MIN_US;
+    
+    for (;;) {
+        if ((sock = socket(AF_INET, SOCK_STREAM, 0)) < 0) {
+            perror("Socket creation error");
+            exit(EXIT_FAILURE);
+        }
+        if (connect(sock, (struct sockaddr *)address, sizeof(*address)) == 0)
+            return sock;
+        
+        close(sock);
+        usleep(backoff);
+        backoff = backoff * 2 > BACKOFF_MAX_US ? BACKOFF_MAX_US : backoff * 2;
+    }
+}
+
 
 /* This function is used to establish which process is first */
 static void * handshake(void * arg) {
@@ -105,7 +135,7 @@ static void * second_process_receive(void * arg) {
     
     /* Do the mmap for the second process using first process' mmap_addr */
     len = info.len;
-    mmap_addr = mmap(info.mmap_addr, len, PROT_READ | PROT_WRITE,
+    mmap_addr = mmap((char *)(uintptr_t)info.mmap_addr, len, PROT_READ | PROT_WRITE,
                 MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
     
     printf("-----------------------------------------------------\n");
@@ -161,9 +191,6 @@ int main(int argc, char ** argv) {
     /* Need to spin up a thread to handle the connection */    
     pthread_create(&thread_id, NULL, handshake, (void *) listen_port);
     
-    /* Then connect to the other server in the main thread */
-    connect_socket = socket(AF_INET, SOCK_STREAM, 0);
-    
     address_out.sin_family = AF_INET;
     address_out.sin_port = htons(*send_port);
     
@@ -173,10 +200,7 @@ int main(int argc, char ** argv) {
     }
     
     /* Client connect here to the other port */
-    while(connect(connect_socket, (struct sockaddr *)&address_out, sizeof(address_out)) < 0) {
-        // perror("Connection failed retrying");
-        sleep(1);
-    }
+    connect_socket = connect_backoff(&address_out);
     
     /* Get current pid */
     pid_buffer = getpid();
@@ -217,7 +241,7 @@ int main(int argc, char ** argv) {
         printf("First process\nmmap_address: %p size: %ld\n", mmap_addr, len);
         
         /* Write both mmap_address + len into struct */
-        info.mmap_addr = mmap_addr;
+        info.mmap_addr = (uintptr_t)mmap_addr;
         info.len = len;
         
         /* Send over as the first message after handshake*/
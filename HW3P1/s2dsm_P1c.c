@@ -8,6 +8,7 @@
 #include <arpa/inet.h>
 #include <pthread.h>
 #include <string.h>
+#include <stdint.h>
 #include <fcntl.h>
 #include <sys/mman.h>
 #include <linux/userfaultfd.h>
@@ -28,12 +29,39 @@ static unsigned long len;           /* numpage * page_size */
 static char * mmap_addr;            /* global mmap address returned */
 static long uffd;                   /* userfaultfd file descriptor */
 
-/* Struct to be send over socket */
+/* Struct to be send over socket, fixed width so both sides agree on the layout */
 struct init_info {
-    char * mmap_addr;
-    unsigned long len;
+    uint64_t mmap_addr;
+    uint64_t len;
 };
 
+/* Retry backoff while the other process isn't listening yet, in us */
+#define BACKOFF_MIN_US 1000
+#define BACKOFF_MAX_US 64000
+
+
+/*
+ * Connect to address, retrying while the other process isn't up yet.
+ * The wait between tries starts at BACKOFF_MIN_US and doubles up to
+ * BACKOFF_MAX_US, so we connect within a few ms of the other side
+ * starting to listen.
+ */
+static int connect_backoff(struct sockaddr_in * address) {
+    int sock;
+    int backoff = BACKOFF_MIN_US;
+    
+    for (;;) {
+        if ((sock = socket(AF_INET, SOCK_STREAM, 0)) < 0)
+            errExit("Socket creation error");
+        if (connect(sock, (struct sockaddr *)address, sizeof(*address)) == 0)
+            return sock;
+        
+        close(sock);
+        usleep(backoff);
+        backoff = backoff * 2 > BACKOFF_MAX_US ? BACKOFF_MAX_US : backoff * 2;
+    }
+}
+
 
 /* This function is used to establish which process is first */
 static void * handshake(void * arg) {
@@ -156,7 +184,7 @@ static void * second_process_receive(void * arg) {
     
     /* Do the mmap for the second process using first process' mmap_addr */
     len = info.len;
-    mmap_addr = mmap(info.mmap_addr, len, PROT_READ | PROT_WRITE,
+    mmap_addr = mmap((char *)(uintptr_t)info.mmap_addr, len, PROT_READ | PROT_WRITE,
                 MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
     if (mmap_addr == MAP_FAILED)
             errExit("mmap failed");
@@ -233,9 +261,6 @@ int main(int argc, char ** argv) {
     /* Do the handshake that listen to establish who is first/second */
     pthread_create(&thread_id, NULL, handshake, (void *) listen_port);
     
-    /* Socket to connect to other thread */
-    connect_socket = socket(AF_INET, SOCK_STREAM, 0);
-    
     address_out.sin_family = AF_INET;
     address_out.sin_port = htons(*send_port);
     
@@ -243,10 +268,7 @@ int main(int argc, char ** argv) {
         errExit("inet_pton failed");
     
     /* Client connect here to the other port */
-    while(connect(connect_socket, (struct sockaddr *)&address_out, sizeof(address_out)) < 0) {
-        // perror("Connection failed retrying");
-        sleep(1);
-    }
+    connect_socket = connect_backoff(&address_out);
     
     /* Get current pid */
     pid_buffer = getpid();
@@ -288,7 +310,7 @@ int main(int argc, char ** argv) {
         printf("First process\nmmap_address: %p size: %ld\n", mmap_addr, len);
         
         /* Write both mmap_address + len into struct */
-        info.mmap_addr = mmap_addr;
+        info.mmap_addr = (uintptr_t)mmap_addr;
         info.len = len;
         
         /* Send over as the first message after handshake*/
@@ -0,0 +1,332 @@
+#include <linux/module.h>
+#include <linux/miscdevice.h>
+#include <linux/fs.h>
+#include <linux/mm.h>
+#include <linux/vmalloc.h>
+#include <linux/slab.h>
+#include <linux/highmem.h>
+#include <linux/mutex.h>
+#include <linux/ktime.h>
+#include <linux/capability.h>
+#include <linux/net.h>
+#include <linux/in.h>
+#include <linux/tcp.h>
+#include <linux/uaccess.h>
+#include <linux/version.h>
+#include <net/net_namespace.h>
+#include "s2dsm_kfast.h"
+
+#define DRIVER_AUTHOR "Ricky Lu ricky.lu@stonybrook.edu"
+#define DRIVER_DESC   "Homework 3 - s2dsm in-kernel fault path"
+
+/*
+ * One region per open of /dev/s2dsm_kfast.
+ * The mutex serializes faults on the region, since they all share
+ * the one socket to the other process and every fetch is a request
+ * followed by its response.
+ */
+struct kfast_region {
+    struct mutex lock;                  /* Held across a whole fetch */
+    struct socket * sock;               /* Connected to the other process, NULL until setup */
+    char * state;                       /* MSI state per page, also mapped by userspace */
+    unsigned long pages;                /* Size of the region in pages */
+    struct s2dsm_kfast_stats stats;     /* Fault timing, read with S2DSM_KFAST_STATS */
+};
+
+/* Keep sending until all of buf went out */
+static int kfast_send_all(struct socket * sock, void * buf, size_t len) {
+    struct msghdr msg;
+    struct kvec iov;
+    int ret;
+    
+    while (len) {
+        memset(&msg, 0, sizeof(msg));
+        msg.msg_flags = MSG_NOSIGNAL;
+        iov.iov_base = buf;
+        iov.iov_len = len;
+        
+        ret = kernel_sendmsg(sock, &msg, &iov, 1, len);
+        if (ret <= 0)
+            return ret ? ret : -ECONNRESET;
+        buf += ret;
+        len -= ret;
+    }
+    return 0;
+}
+
+/* Keep receiving until buf is full */
+static int kfast_recv_all(struct socket * sock, void * buf, size_t len) {
+    struct msghdr msg;
+    struct kvec iov;
+    int ret;
+    
+    while (len) {
+        memset(&msg, 0, sizeof(msg));
+        iov.iov_base = buf;
+        iov.iov_len = len;
+        
+        ret = kernel_recvmsg(sock, &msg, &iov, 1, len, MSG_WAITALL);
+        if (ret <= 0)
+            return ret ? ret : -ECONNRESET;
+        buf += ret;
+        len -= ret;
+    }
+    return 0;
+}
+
+/*
+ * Same exchange as the fault handler thread in s2dsm_P2.c: send 'F',
+ * '0' back means the other copy is invalid too and the zeroed page
+ * stays, '1' is followed by the page contents.
+ */
+static int kfast_fetch(struct kfast_region * kf, pgoff_t which, struct page * page) {
+    struct s2dsm_kfast_request request;
+    char response;
+    void * addr;
+    int ret;
+    
+    memset(&request, 0, sizeof(request));   /* Don't leak padding over the socket */
+    request.request_type = 'F';
+    request.which_page = which;
+    
+    if ((ret = kfast_send_all(kf->sock, &request, sizeof(request))))
+        return ret;
+    if ((ret = kfast_recv_all(kf->sock, &response, sizeof(response))))
+        return ret;
+    
+    if (response == '1') {
+        addr = kmap(page);
+        ret = kfast_recv_all(kf->sock, addr, PAGE_SIZE);
+        kunmap(page);
+    }
+    return ret;
+}
+
+/*
+ * Fault on the region. Like the uffd path every fault hands out a fresh
+ * page: a missing pte means the old contents were invalidated (madvise
+ * from userspace) or never there. If two threads race on one page the
+ * loser's page is simply dropped by the core fault code.
+ */
+static vm_fault_t kfast_fault(struct vm_fault * vmf) {
+    struct kfast_region * kf = vmf->vma->vm_private_data;
+    pgoff_t which = vmf->pgoff;
+    struct page * page;
+    u64 start = ktime_get_ns();
+    u64 elapsed;
+    int ret;
+    
+    if (which >= kf->pages)
+        return VM_FAULT_SIGBUS;
+    
+    page = alloc_page(GFP_HIGHUSER | __GFP_ZERO);
+    if (!page)
+        return VM_FAULT_OOM;
+    
+    mutex_lock(&kf->lock);
+    if (READ_ONCE(kf->state[which]) == S2DSM_KFAST_INVALID) {
+        if ((ret = kfast_fetch(kf, which, page))) {
+            mutex_unlock(&kf->lock);
+            printk(KERN_ERR "s2dsm_kfast: fetching page %lu failed, returned %d\n", which, ret);
+            __free_page(page);
+            return VM_FAULT_SIGBUS;
+        }
+        WRITE_ONCE(kf->state[which], S2DSM_KFAST_SHARED);
+        kf->stats.fetches++;
+    }
+    
+    elapsed = ktime_get_ns() - start;
+    kf->stats.faults++;
+    kf->stats.total_ns += elapsed;
+    if (elapsed > kf->stats.max_ns)
+        kf->stats.max_ns = elapsed;
+    mutex_unlock(&kf->lock);
+    
+    /* Our reference from alloc_page becomes the mapping's */
+    vmf->page = page;
+    return 0;
+}
+
+static const struct vm_operations_struct kfast_vm_ops = {
+    .fault = kfast_fault,
+};
+
+/* Allocate the state array and connect to the other process */
+static long kfast_setup(struct kfast_region * kf, struct s2dsm_kfast_setup __user * arg) {
+    struct s2dsm_kfast_setup setup;
+    struct sockaddr_in addr;
+    int ret = 0;
+    
+    /* Connects a kernel socket to whatever address userspace hands us */
+    if (!capable(CAP_NET_ADMIN))
+        return -EPERM;
+    if (copy_from_user(&setup, arg, sizeof(setup)))
+        return -EFAULT;
+    if (!setup.pages || setup.pages > S2DSM_KFAST_MAX_PAGES)
+        return -EINVAL;
+    
+    mutex_lock(&kf->lock);
+    if (kf->sock) {
+        ret = -EBUSY;
+        goto out;
+    }
+    
+    /* vmalloc_user so userspace can map it, every page starts out invalid */
+    kf->state = vmalloc_user(setup.pages);
+    if (!kf->state) {
+        ret = -ENOMEM;
+        goto out;
+    }
+    memset(kf->state, S2DSM_KFAST_INVALID, setup.pages);
+    
+    ret = sock_create_kern(&init_net, AF_INET, SOCK_STREAM, IPPROTO_TCP, &kf->sock);
+    if (ret)
+        goto free_state;
+    
+    memset(&addr, 0, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_addr.s_addr = setup.peer_addr;
+    addr.sin_port = htons(setup.peer_port);
+    
+    ret = kernel_connect(kf->sock, (struct sockaddr *)&addr, sizeof(addr), 0);
+    if (ret)
+        goto release_sock;
+    
+    /* Requests are tiny and latency bound, don't let Nagle hold them back */
+    tcp_sock_set_nodelay(kf->sock->sk);
+    
+    kf->pages = setup.pages;
+    mutex_unlock(&kf->lock);
+    return 0;
+
+release_sock:
+    sock_release(kf->sock);
+    kf->sock = NULL;
+free_state:
+    vfree(kf->state);
+    kf->state = NULL;
+out:
+    mutex_unlock(&kf->lock);
+    return ret;
+}
+
+static long kfast_ioctl(struct file * file, unsigned int cmd, unsigned long arg) {
+    struct kfast_region * kf = file->private_data;
+    struct s2dsm_kfast_stats stats;
+    
+    switch (cmd) {
+        case S2DSM_KFAST_SETUP:
+        return kfast_setup(kf, (struct s2dsm_kfast_setup __user *)arg);
+        
+        case S2DSM_KFAST_STATS:
+        mutex_lock(&kf->lock);
+        stats = kf->stats;
+        mutex_unlock(&kf->lock);
+        if (copy_to_user((void __user *)arg, &stats, sizeof(stats)))
+            return -EFAULT;
+        return 0;
+        
+        default:
+        return -ENOTTY;
+    }
+}
+
+/*
+ * Offset 0 maps the region itself, which has to be MAP_SHARED and
+ * exactly the size given at setup. S2DSM_KFAST_STATE_PGOFF maps the
+ * state array instead.
+ */
+static int kfast_mmap(struct file * file, struct vm_area_struct * vma) {
+    struct kfast_region * kf = file->private_data;
+    unsigned long size = vma->vm_end - vma->vm_start;
+    int ret = 0;
+    
+    /* Setup may be running on another thread of the same file */
+    mutex_lock(&kf->lock);
+    if (!kf->sock) {
+        ret = -EINVAL;
+        goto out;
+    }
+    
+    if (vma->vm_pgoff == S2DSM_KFAST_STATE_PGOFF) {
+        ret = remap_vmalloc_range(vma, kf->state, 0);
+        goto out;
+    }
+    
+    if (vma->vm_pgoff != 0 || size != kf->pages << PAGE_SHIFT || !(vma->vm_flags & VM_SHARED)) {
+        ret = -EINVAL;
+        goto out;
+    }
+    
+    vma->vm_ops = &kfast_vm_ops;
+    vma->vm_private_data = kf;
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(6, 3, 0)
+    vm_flags_set(vma, VM_DONTEXPAND | VM_DONTDUMP);
+#else
+    vma->vm_flags |= VM_DONTEXPAND | VM_DONTDUMP;
+#endif
+out:
+    mutex_unlock(&kf->lock);
+    return ret;
+}
+
+static int kfast_open(struct inode * inode, struct file * file) {
+    struct kfast_region * kf = kzalloc(sizeof(struct kfast_region), GFP_KERNEL);
+    
+    if (!kf)
+        return -ENOMEM;
+    mutex_init(&kf->lock);
+    file->private_data = kf;
+    return 0;
+}
+
+/* Mappings hold a reference to the file, so nothing can fault anymore */
+static int kfast_release(struct inode * inode, struct file * file) {
+    struct kfast_region * kf = file->private_data;
+    
+    if (kf->sock)
+        sock_release(kf->sock);
+    vfree(kf->state);
+    kfree(kf);
+    return 0;
+}
+
+static const struct file_operations kfast_fops = {
+    .owner = THIS_MODULE,
+    .open = kfast_open,
+    .release = kfast_release,
+    .unlocked_ioctl = kfast_ioctl,
+    .mmap = kfast_mmap,
+};
+
+static struct miscdevice kfast_device = {
+    .minor = MISC_DYNAMIC_MINOR,
+    .name = "s2dsm_kfast",
+    .fops = &kfast_fops,
+    .mode = 0600,
+};
+
+static int __init kfast_init(void) {
+    int ret;
+    
+    ret = misc_register(&kfast_device);
+    if (ret < 0) {
+        printk(KERN_ERR "misc_register failed, returned %d\n", ret);
+        return ret;
+    }
+    printk(KERN_INFO "s2dsm_kfast loaded at %s\n", S2DSM_KFAST_DEV);
+    return 0;
+}
+
+static void __exit kfast_exit(void) {
+    misc_deregister(&kfast_device);
+    printk(KERN_INFO "s2dsm_kfast unloaded\n");
+}
+
+module_init(kfast_init);
+module_exit(kfast_exit);
+
+MODULE_LICENSE("GPL");
+
+MODULE_AUTHOR(DRIVER_AUTHOR);
+MODULE_DESCRIPTION(DRIVER_DESC);
@@ -0,0 +1,48 @@
+#ifndef S2DSM_KFAST_H
+#define S2DSM_KFAST_H
+
+#include <linux/types.h>
+#include <linux/ioctl.h>
+
+/*
+ * Interface between s2dsm -k and the s2dsm_kfast module. The module
+ * resolves faults on a region mmap'ed from S2DSM_KFAST_DEV in kernel
+ * context, fetching invalid pages from the other process over an
+ * in-kernel socket. Userspace keeps doing invalidations, updates and
+ * policy, and shares the per page MSI state with the module by
+ * mmap'ing S2DSM_KFAST_STATE_PGOFF.
+ */
+#define S2DSM_KFAST_DEV "/dev/s2dsm_kfast"
+#define S2DSM_KFAST_STATE_PGOFF 0x100000UL      /* mmap offset of the state array, in pages */
+#define S2DSM_KFAST_MAX_PAGES S2DSM_KFAST_STATE_PGOFF
+#define S2DSM_KFAST_PORT_OFFSET 1000            /* Fetches are served on listen port + this */
+
+/* Same values as msi_array in s2dsm_P2.c */
+#define S2DSM_KFAST_MODIFIED 1
+#define S2DSM_KFAST_SHARED 2
+#define S2DSM_KFAST_INVALID 3
+
+/* Same layout as struct msg_request in s2dsm_P2.c */
+struct s2dsm_kfast_request {
+    char request_type;
+    int which_page;
+};
+
+struct s2dsm_kfast_setup {
+    __u32 pages;            /* Size of the region in pages */
+    __u32 peer_addr;        /* IPv4 address of the other process, network order */
+    __u16 peer_port;        /* Port the other process serves fetches on */
+    __u16 pad;
+};
+
+struct s2dsm_kfast_stats {
+    __u64 faults;           /* Faults resolved */
+    __u64 fetches;          /* Faults that went to the other process */
+    __u64 total_ns;         /* Time spent resolving faults */
+    __u64 max_ns;           /* Slowest fault */
+};
+
+#define S2DSM_KFAST_SETUP _IOW('k', 1, struct s2dsm_kfast_setup)
+#define S2DSM_KFAST_STATS _IOR('k', 2, struct s2dsm_kfast_stats)
+
+#endif
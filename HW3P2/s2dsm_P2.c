@@ -6,6 +6,7 @@
 #include <sys/socket.h>
 #include <netinet/in.h>
 #include <arpa/inet.h>
+#include <netinet/tcp.h>
 #include <pthread.h>
 #include <string.h>
 #include <fcntl.h>
@@ -14,6 +15,10 @@
 #include <sys/syscall.h>
 #include <sys/ioctl.h>
 #include <poll.h>
+#include <time.h>
+#include <stdint.h>
+#include "s2dsm_trace.h"
+#include "kfast/s2dsm_kfast.h"
 
 #define MAX_SIZE 50
 #define errExit(str) do { \
@@ -29,6 +34,11 @@ static unsigned long len;           /* numpage * page_size */
 static char * mmap_addr;            /* global mmap address returned */
 static long uffd;                   /* userfaultfd file descriptor */
 static char * msi_array;            /* An array of chars. The size of the array is = num pages */
+static FILE * trace_file;           /* Binary trace of faults, accesses and requests, NULL if off */
+static int kfast_fd = -1;           /* /dev/s2dsm_kfast with -k, faults get resolved in the kernel */
+static int peer_port;               /* Port the other process listens on */
+static char peer_host[INET_ADDRSTRLEN] = "127.0.0.1";  /* Address the other process listens on */
+static int preloaded_pages;         /* Pages filled from -f that the bootstrap sync streams */
 
 #define MODIFIED 1
 #define SHARED 2
@@ -37,48 +47,339 @@ static char * msi_array;            /* An array of chars. The size of the array
 #define SHARED_S "Shared"
 #define INVALID_S "Invalid"
 
-/* Struct to be send over socket */
+/*
+ * Per page write policy. Invalidate is the plain MSI behavior,
+ * update pushes the written bytes to the other copy instead, and
+ * adaptive switches between the two depending on whether the
+ * other process actually reads what we push.
+ */
+#define POLICY_INVALIDATE 0
+#define POLICY_UPDATE 1
+#define POLICY_ADAPTIVE 2
+#define POLICY_INVALIDATE_S "invalidate"
+#define POLICY_UPDATE_S "update"
+#define POLICY_ADAPTIVE_S "adaptive"
+
+#define PROMOTE_THRESHOLD 2     /* Fetches right after our invalidation before switching to update */
+#define DEMOTE_THRESHOLD 2      /* Pushed copies never read before switching to invalidate */
+
+/* Bookkeeping kept for every page next to msi_array */
+struct page_info {
+    char policy;                /* POLICY_* picked by the user */
+    char update;                /* 1 if writes are currently pushed instead of invalidated */
+    unsigned char refetch;      /* Writer: fetches that came back right after an invalidation */
+    unsigned char unread;       /* Reader: pushed copies that got overwritten before being read */
+    char pushed;                /* Reader: 1 if the last pushed copy was not read yet */
+};
+
+static struct page_info * page_array;   /* An array of page_info. The size of the array is = num pages */
+
+/* Fault latency, to compare the uffd path against s2dsm_kfast */
+struct fault_stats {
+    unsigned long count;
+    uint64_t total_ns;
+    uint64_t max_ns;
+};
+
+static struct fault_stats access_stats;     /* Accesses to invalid pages, as the REPL saw them */
+static struct fault_stats handler_stats;    /* Time the uffd handler thread spent per fault */
+static pthread_mutex_t send_lock = PTHREAD_MUTEX_INITIALIZER;   /* Serialize writes on connect_socket */
+
+/*
+ * Everything coming back on connect_socket is read by reply_thread.
+ * 'F' responses are handed to the fault handler through fetch_response,
+ * 'A' acks are counted so a writer can fence on its invalidations.
+ */
+static pthread_mutex_t reply_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t reply_cond = PTHREAD_COND_INITIALIZER;
+static unsigned long acks_expected;     /* 'I' and 'U' requests sent so far */
+static unsigned long acks_received;     /* 'A' replies read so far */
+static char fetch_response;             /* '0'/'1' of the outstanding 'F', 0 while pending */
+static char * fetch_page;               /* Where the page of a '1' response goes */
+
+/* Struct to be send over socket, fixed width so both sides agree on the layout */
 struct init_info {
-    char * mmap_addr;
-    unsigned long len;
+    uint64_t mmap_addr;         /* Where the first process mapped the region */
+    uint64_t len;               /* Size of the region */
+    uint32_t sync;              /* 1 if a bootstrap sync stream follows */
+    uint32_t pad;
+};
+
+/*
+ * Bootstrap mode (-m). Every process reads the same membership file,
+ * one "<id> <ipv4 address> <port>" line per member, and the member
+ * with the lowest id leads: it sizes the region and streams it to
+ * the others. s2dsm's protocol is between two processes, so the file
+ * has to list exactly two members.
+ */
+#define MAX_MEMBERS 2
+#define HELLO_MAGIC 0x53324453      /* "S2DS" */
+#define BACKOFF_MIN_US 1000         /* First retry of a refused connect */
+#define BACKOFF_MAX_US 64000        /* Retries never wait longer than this */
+#define CONNECT_TIMEOUT_MS 30000    /* Give up on members that never show up */
+
+struct member {
+    int id;
+    char host[INET_ADDRSTRLEN];
+    int port;
+};
+
+/* First thing sent on a bootstrap connection, tells the acceptor who connected */
+struct hello_info {
+    uint32_t magic;             /* HELLO_MAGIC */
+    uint32_t id;                /* Member id of the sender */
+};
+
+/* Header of a run of pages in the bootstrap sync stream, count 0 ends it */
+struct sync_run {
+    uint32_t first;             /* First page of the run */
+    uint32_t count;             /* Pages that follow */
 };
 
 /*
  * 'F': For fetching specified page
  * 'I': For invalidating specified page
+ * 'U': For updating specified page, followed by struct update_info and the bytes
+ * 'D': Tell the writer its pushed copies of specified page are not being read
+ *
+ * 'I' and 'U' are acknowledged with a single 'A' once applied.
  */
 struct msg_request {
     char request_type;           /* Hold the request type */
     int which_page;              /* Which page is it requesting */
 };
 
+/* Which part of the page an 'U' request carries */
+struct update_info {
+    int offset;                  /* First byte that changed */
+    int length;                  /* How many bytes follow */
+};
+
+
+/* CLOCK_MONOTONIC in ns */
+static uint64_t now_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+
+/* Add one fault that took elapsed ns */
+static void account(struct fault_stats * stats, uint64_t elapsed) {
+    stats->count++;
+    stats->total_ns += elapsed;
+    if (elapsed > stats->max_ns)
+        stats->max_ns = elapsed;
+}
+
+
+static void print_stats(const char * what, unsigned long count, uint64_t total_ns, uint64_t max_ns) {
+    printf("  [*]  %s: %lu, avg %.1f us, max %.1f us\n", what, count,
+            count ? total_ns / 1000.0 / count : 0.0, max_ns / 1000.0);
+}
+
+
+/* Append one record to the trace, does nothing unless -t was given */
+static void trace_event(char event, int which_page, char arg, unsigned long len) {
+    struct trace_record record;
+    
+    if (!trace_file)
+        return;
+    
+    record.ts = now_ns();
+    record.page = which_page;
+    record.event = event;
+    record.arg = arg;
+    record.len = len > UINT16_MAX ? UINT16_MAX : len;
+    
+    /* fwrite locks the stream, records from different threads don't interleave */
+    if (fwrite(&record, sizeof(record), 1, trace_file) != 1)
+        errExit("Trace write failed");
+}
+
+
+/* Keep reading until count bytes arrived, the socket can hand them back in pieces */
+static void read_full(int fd, void * buf, size_t count) {
+    size_t done = 0;
+    ssize_t bytes_read;
+    
+    while (done < count) {
+        if ((bytes_read = read(fd, (char *)buf + done, count - done)) < 0)
+            errExit("Reading error");
+        else if (bytes_read == 0) {
+            printf("Connection resetted\n");
+            exit(EXIT_FAILURE);
+        }
+        done += bytes_read;
+    }
+}
+
+
+/* Count one more request that the other process is going to ack */
+static void expect_ack(void) {
+    pthread_mutex_lock(&reply_lock);
+    acks_expected++;
+    pthread_mutex_unlock(&reply_lock);
+}
+
+
+/*
+ * Wait until every 'I' and 'U' sent so far has been applied by the
+ * other process. Writes don't wait on their own, so a writer can
+ * put out requests for many pages and only pay the round trip here.
+ */
+static void fence(void) {
+    uint64_t start = now_ns();
+    
+    pthread_mutex_lock(&reply_lock);
+    unsigned long target = acks_expected;
+    while (acks_received < target)
+        pthread_cond_wait(&reply_cond, &reply_lock);
+    pthread_mutex_unlock(&reply_lock);
+    
+    trace_event(TRACE_FENCE, 0, 0, (now_ns() - start) / 1000);
+}
+
+
+/* Keep writing until count bytes went out */
+static void write_full(int fd, const void * buf, size_t count) {
+    size_t done = 0;
+    ssize_t bytes_write;
+    
+    while (done < count) {
+        if ((bytes_write = write(fd, (const char *)buf + done, count - done)) < 0)
+            errExit("Writing error");
+        done += bytes_write;
+    }
+}
+
 
 /* Used to abstract away the request sending */
 static void sent_request(char request_type, int which_page) {
-    int bytes_write;
     struct msg_request request;
     request.request_type = request_type;
     request.which_page = which_page;
     
-    if ((bytes_write = write(connect_socket, &request, sizeof(request))) < 0)
-        errExit("Writing error");
+    if (request_type == 'I')
+        expect_ack();
+    
+    pthread_mutex_lock(&send_lock);
+    write_full(connect_socket, &request, sizeof(request));
+    pthread_mutex_unlock(&send_lock);
+    
+    trace_event(TRACE_SEND, which_page, request_type, 0);
 }
 
 
-/* This function is used to establish which process is first */
-static void * handshake(void * arg) {
-    int * pid_buffer = malloc(sizeof(pid_t)); /* Read other process' pid*/
-    int current_pid = getpid();               /* Get current process' pid */
+/* Push length bytes starting at offset of the page to the other process */
+static void sent_update(int which_page, int offset, int length) {
+    struct msg_request request;
+    struct update_info update;
+    char * address_loc = mmap_addr + (which_page * page_size);
+    
+    request.request_type = 'U';
+    request.which_page = which_page;
+    update.offset = offset;
+    update.length = length;
     
-    /* Socket stuff */
+    expect_ack();
+    
+    /* All three writes have to go out back to back */
+    pthread_mutex_lock(&send_lock);
+    write_full(connect_socket, &request, sizeof(request));
+    write_full(connect_socket, &update, sizeof(update));
+    write_full(connect_socket, address_loc + offset, length);
+    pthread_mutex_unlock(&send_lock);
+    
+    trace_event(TRACE_SEND, which_page, 'U', length);
+}
+
+
+/* Allocate msi_array and page_array, every page starts out invalid */
+static void init_page_arrays(int pages) {
+    /* With -k msi_array is shared with s2dsm_kfast instead */
+    if (kfast_fd == -1) {
+        msi_array = malloc(sizeof(char) * pages); /* Allocate a char per page for MSI protocol */
+        for (char * ptr = msi_array; ptr < msi_array + pages; ptr++)
+            *ptr = INVALID;
+    }
+    
+    page_array = calloc(pages, sizeof(struct page_info));
+    if (page_array == NULL)
+        errExit("calloc failed");
+    
+    /* Size of the region is known now, start the trace */
+    if (trace_file) {
+        struct trace_header header;
+        header.magic = TRACE_MAGIC;
+        header.version = TRACE_VERSION;
+        header.node = first_process ? 0 : 1;
+        header.page_size = page_size;
+        header.pages = pages;
+        if (fwrite(&header, sizeof(header), 1, trace_file) != 1)
+            errExit("Trace write failed");
+    }
+}
+
+
+/*
+ * Write msg into the page and keep the other copy coherent, either
+ * by invalidating it or by pushing the bytes that changed. twin is
+ * a page sized scratch buffer used to diff against the old contents.
+ */
+static void write_page(int which_page, char * msg, char * twin) {
+    char * address_loc = mmap_addr + (which_page * page_size);
+    struct page_info * info = &page_array[which_page];
+    int was_modified;
+    int fetching = msi_array[which_page] == INVALID;
+    int first, last;
+    uint64_t start;
+    
+    trace_event(TRACE_WRITE, which_page, msi_array[which_page], strnlen(msg, page_size));
+    
+    start = now_ns();
+    memcpy(twin, address_loc, page_size);   /* Will trigger page-fault on initial write */
+    if (fetching)
+        account(&access_stats, now_ns() - start);
+    was_modified = msi_array[which_page] == MODIFIED;
+    strncpy(address_loc, msg, page_size);
+    
+    if (!info->update) {
+        /* Previous invalidation was never followed by a fetch, not a consumer */
+        if (was_modified)
+            info->refetch = 0;
+        msi_array[which_page] = MODIFIED;
+        sent_request('I', which_page);
+        return;
+    }
+    
+    if (was_modified) {
+        /* Other copy is invalid, it needs the whole page */
+        first = 0;
+        last = page_size;
+    }
+    else {
+        /* Other copy matches twin, only send the bytes that changed */
+        for (first = 0; first < page_size && twin[first] == address_loc[first]; first++)
+            ;
+        for (last = page_size; last > first && twin[last - 1] == address_loc[last - 1]; last--)
+            ;
+    }
+    
+    if (first < last)
+        sent_update(which_page, first, last - first);
+    msi_array[which_page] = SHARED;
+}
+
+
+/* Listen on server_port and return the first connection accepted */
+static int accept_one(int server_port) {
     int sockfd;                         /* Socket used for listening */
+    int sock;                           /* Accepted connection */
     struct sockaddr_in address;         /* Used for setting up the server accept socket */
     int opt = 1;                        /* Enable boolean option */
-    int server_port = *((int *)arg);    /* Get server port from arg */
     int address_len = sizeof(address);
     
-    int bytes_read;                     /* Used for read */
-    
     if ((sockfd = socket(AF_INET, SOCK_STREAM, 0)) < 0)
         errExit("Socket creation error");
     
@@ -98,10 +399,191 @@ static void * handshake(void * arg) {
         errExit("Listen failed");
     
     /* Wait for connection */
-    if ((accepted_socket = accept(sockfd, (struct sockaddr *)&address, 
+    if ((sock = accept(sockfd, (struct sockaddr *)&address, 
             (socklen_t *)&address_len)) < 0)
         errExit("Accept failed");
     
+    /* Replies are a byte followed by the page, don't let Nagle hold the page back */
+    if (setsockopt(sock, IPPROTO_TCP, TCP_NODELAY, &opt, sizeof(opt)))
+        errExit("Setsockopt failed");
+    
+    close(sockfd);
+    return sock;
+}
+
+
+/*
+ * Connect to all count addresses at once with non-blocking sockets.
+ * A refused connect (the other side isn't listening yet) is retried
+ * after a backoff starting at BACKOFF_MIN_US and doubling up to
+ * BACKOFF_MAX_US, so a group is up as soon as its last member is
+ * instead of on the next sleep(1). Connected sockets come back
+ * blocking with TCP_NODELAY set in socks.
+ */
+static void connect_all(struct sockaddr_in * addrs, int * socks, int count) {
+    int backoff[count];             /* Next backoff per address, in us */
+    uint64_t retry_at[count];       /* When to try an address again */
+    int connecting[count];          /* 1 while a connect is in flight */
+    int remaining = count;
+    int opt = 1;
+    uint64_t deadline = now_ns() + CONNECT_TIMEOUT_MS * 1000000ULL;
+    
+    for (int i = 0; i < count; i++) {
+        socks[i] = -1;
+        backoff[i] = BACKOFF_MIN_US;
+        retry_at[i] = 0;
+        connecting[i] = 0;
+    }
+    
+    while (remaining) {
+        struct pollfd pollfds[count];
+        int polled[count];
+        int npoll = 0;
+        uint64_t now = now_ns();
+        uint64_t wake = deadline;
+        
+        if (now >= deadline) {
+            printf("Timed out connecting to the other members\n");
+            exit(EXIT_FAILURE);
+        }
+        
+        for (int i = 0; i < count; i++) {
+            if (socks[i] != -1 && !connecting[i])
+                continue;       /* Done */
+            
+            if (socks[i] == -1 && now >= retry_at[i]) {
+                if ((socks[i] = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK, 0)) < 0)
+                    errExit("Socket creation error");
+                
+                if (connect(socks[i], (struct sockaddr *)&addrs[i], sizeof(addrs[i])) == 0)
+                    connecting[i] = 0;
+                else if (errno == EINPROGRESS)
+                    connecting[i] = 1;
+                else {
+                    close(socks[i]);
+                    socks[i] = -1;
+                }
+                
+                if (socks[i] != -1 && !connecting[i]) {
+                    remaining--;
+                    continue;
+                }
+            }
+            
+            if (socks[i] == -1) {
+                /* Refused, back off */
+                if (now >= retry_at[i]) {
+                    retry_at[i] = now + backoff[i] * 1000ULL;
+                    backoff[i] = backoff[i] * 2 > BACKOFF_MAX_US ? BACKOFF_MAX_US : backoff[i] * 2;
+                }
+                if (retry_at[i] < wake)
+                    wake = retry_at[i];
+                continue;
+            }
+            
+            pollfds[npoll].fd = socks[i];
+            pollfds[npoll].events = POLLOUT;
+            polled[npoll++] = i;
+        }
+        
+        if (!remaining)
+            break;
+        
+        if (poll(pollfds, npoll, (wake - now + 999999) / 1000000) == -1)
+            errExit("Poll failed");
+        
+        for (int j = 0; j < npoll; j++) {
+            int i = polled[j];
+            int error = 0;
+            socklen_t error_len = sizeof(error);
+            
+            if (!pollfds[j].revents)
+                continue;
+            if (getsockopt(socks[i], SOL_SOCKET, SO_ERROR, &error, &error_len))
+                errExit("Getsockopt failed");
+            
+            connecting[i] = 0;
+            if (error) {
+                close(socks[i]);
+                socks[i] = -1;
+                retry_at[i] = 0;    /* Schedules the backoff on the next pass */
+                continue;
+            }
+            remaining--;
+        }
+    }
+    
+    for (int i = 0; i < count; i++) {
+        if (fcntl(socks[i], F_SETFL, fcntl(socks[i], F_GETFL) & ~O_NONBLOCK) == -1)
+            errExit("Fcntl failed");
+        if (setsockopt(socks[i], IPPROTO_TCP, TCP_NODELAY, &opt, sizeof(opt)))
+            errExit("Setsockopt failed");
+    }
+}
+
+
+/* Read the membership file, returns how many members it lists */
+static int read_members(const char * path, struct member * members) {
+    FILE * file;
+    char line[256];
+    int count = 0;
+    
+    if ((file = fopen(path, "r")) == NULL)
+        errExit("Opening membership file failed");
+    
+    while (fgets(line, sizeof(line), file)) {
+        struct member * member = &members[count];
+        struct in_addr addr;
+        char * start = line + strspn(line, " \t");
+        
+        if (*start == '#' || *start == '\n' || *start == 0)
+            continue;
+        if (count == MAX_MEMBERS) {
+            printf("%s: more than %d members\n", path, MAX_MEMBERS);
+            exit(EXIT_FAILURE);
+        }
+        if (sscanf(start, "%d %15s %d", &member->id, member->host, &member->port) != 3 ||
+                inet_pton(AF_INET, member->host, &addr) <= 0) {
+            printf("%s: expected \"<id> <ipv4 address> <port>\", got: %s", path, line);
+            exit(EXIT_FAILURE);
+        }
+        for (int i = 0; i < count; i++) {
+            if (members[i].id == member->id) {
+                printf("%s: member id %d listed twice\n", path, member->id);
+                exit(EXIT_FAILURE);
+            }
+        }
+        count++;
+    }
+    fclose(file);
+    return count;
+}
+
+
+/* Bootstrap counterpart of handshake(), learns which member connected from its hello */
+static void * member_handshake(void * arg) {
+    struct member * peer = arg;
+    struct hello_info hello;
+    
+    accepted_socket = accept_one(peer[1].port);     /* peer[1] is ourselves */
+    read_full(accepted_socket, &hello, sizeof(hello));
+    if (hello.magic != HELLO_MAGIC || hello.id != peer[0].id) {
+        printf("Unexpected member connected (id %u)\n", hello.id);
+        exit(EXIT_FAILURE);
+    }
+    
+    pthread_exit(NULL);
+}
+
+
+/* This function is used to establish which process is first */
+static void * handshake(void * arg) {
+    int * pid_buffer = malloc(sizeof(pid_t)); /* Read other process' pid*/
+    int current_pid = getpid();               /* Get current process' pid */
+    int server_port = *((int *)arg);    /* Get server port from arg */
+    int bytes_read;                     /* Used for read */
+    
+    accepted_socket = accept_one(server_port);
     printf("Accepted connection\n");
     
     /* Read from the pid to compare pid */
@@ -122,7 +604,8 @@ static void * fault_handler_thread(void * arg) {
     long uffd = (long)arg;          /* Retrieve uffd from thread arg */
     static char *page = NULL;       /* Page used to copy */
     int page_faulted;               /* Used to store which page faulted */
-    int bytes_read;
+    char state;                     /* MSI state of the page when it faulted */
+    uint64_t fault_start;           /* When the fault was read off uffd */
     
     /* This page will be used to resolve the page fault. handle by kernel for its page fault */
     if (page == NULL) {
@@ -154,7 +637,9 @@ static void * fault_handler_thread(void * arg) {
         }
         
         printf("  [x]  PAGEFAULT\n");
+        fault_start = now_ns();
         page_faulted = ((char *)msg.arg.pagefault.address - mmap_addr) / page_size;
+        state = msi_array[page_faulted];
         
         memset(page, 0, page_size); /* Clear out the page to 0 */
         
@@ -162,11 +647,20 @@ static void * fault_handler_thread(void * arg) {
         if (msi_array[page_faulted] == INVALID) {
             char response;
             
+            pthread_mutex_lock(&reply_lock);
+            fetch_response = 0;
+            fetch_page = page;
+            pthread_mutex_unlock(&reply_lock);
+            
             /* Fetch request */
             sent_request('F', page_faulted);
-
-            if ((bytes_read = read(connect_socket, &response, sizeof(response))) < 0)
-                errExit("Reading error");
+            
+            /* reply_thread reads the response, wait for it to show up */
+            pthread_mutex_lock(&reply_lock);
+            while (!fetch_response)
+                pthread_cond_wait(&reply_cond, &reply_lock);
+            response = fetch_response;
+            pthread_mutex_unlock(&reply_lock);
             
             if (response == '0') {
                 /* If response is 0 means their page is also invalid */
@@ -175,9 +669,7 @@ static void * fault_handler_thread(void * arg) {
             }
             else if (response == '1') {
                 /* If response is 1 means they are giving back some pages */
-                /* Read the page send by the server thread */
-                if ((bytes_read = read(connect_socket, page, page_size)) < 0)
-                    errExit("Reading error");
+                /* reply_thread already read the page into page */
                 msi_array[page_faulted] = SHARED;
             }
             
@@ -193,39 +685,88 @@ static void * fault_handler_thread(void * arg) {
         /* Copy the allocated page to the faulted page */
         if (ioctl(uffd, UFFDIO_COPY, &uffdio_copy) == -1)
             errExit("ioctl-UFFDIO_COPY");
+        
+        account(&handler_stats, now_ns() - fault_start);
+        trace_event(TRACE_FAULT, page_faulted, state, (now_ns() - fault_start) / 1000);
     }
 }
 
 
-/* Used for second process only to receive handshake msg */
-static void * second_process_receive(void * arg) {
-    /* This thread will be handle the reading from socket for 2nd process */    
-    int bytes_read;
+/*
+ * Install count pages of data starting at page first on pages that are
+ * not mapped here, without the fault path going to fetch them.
+ */
+static void install_pages(int first, int count, char * data) {
+    char * address_loc = mmap_addr + (first * page_size);
+    struct uffdio_copy uffdio_copy;
+    
+    if (kfast_fd != -1) {
+        /* Shared first so s2dsm_kfast hands out blank pages instead of fetching */
+        memset(msi_array + first, SHARED, count);
+        memcpy(address_loc, data, count * page_size);
+        return;
+    }
+    
+    uffdio_copy.src = (unsigned long) data;
+    uffdio_copy.dst = (unsigned long) address_loc;
+    uffdio_copy.len = count * page_size;
+    uffdio_copy.mode = 0;
+    uffdio_copy.copy = 0;
+    
+    /* EEXIST: got faulted in meanwhile, fall back to copying into it */
+    if (ioctl(uffd, UFFDIO_COPY, &uffdio_copy) == -1) {
+        if (errno != EEXIST)
+            errExit("ioctl-UFFDIO_COPY");
+        memset(msi_array + first, SHARED, count);
+        memcpy(address_loc, data, count * page_size);
+    }
+    memset(msi_array + first, SHARED, count);
+}
+
+
+/*
+ * Map len bytes at addr (NULL lets the kernel pick) as the shared region
+ * and get its faults resolved, either by a uffd handler thread or, with
+ * -k, by s2dsm_kfast in the kernel.
+ */
+static void map_region(char * addr) {
+    int pages = len / page_size;
     pthread_t thread_id;
     
-    struct init_info info;          /* Used for storing the bytes read from first process */
-    if ((bytes_read = read(accepted_socket, &info, sizeof(struct init_info))) < 0)
-        errExit("Read error");
-    else if (bytes_read == 0) {
-        printf("The connection was resetted by peer\n");
-        exit(EXIT_FAILURE);
+    if (kfast_fd != -1) {
+        struct s2dsm_kfast_setup setup;
+        
+        memset(&setup, 0, sizeof(setup));
+        setup.pages = pages;
+        setup.peer_port = peer_port + S2DSM_KFAST_PORT_OFFSET;
+        if (inet_pton(AF_INET, peer_host, &setup.peer_addr) <= 0)
+            errExit("inet_pton failed");
+        
+        /* The module connects to our peer's fetch server here */
+        if (ioctl(kfast_fd, S2DSM_KFAST_SETUP, &setup) == -1)
+            errExit("ioctl-S2DSM_KFAST_SETUP error");
+        
+        mmap_addr = mmap(addr, len, PROT_READ | PROT_WRITE, MAP_SHARED, kfast_fd, 0);
+        if (mmap_addr == MAP_FAILED)
+            errExit("mmap failed");
+        
+        msi_array = mmap(NULL, pages, PROT_READ | PROT_WRITE, MAP_SHARED, kfast_fd,
+                S2DSM_KFAST_STATE_PGOFF * page_size);
+        if (msi_array == MAP_FAILED)
+            errExit("mmap failed");
+        
+        init_page_arrays(pages);
+        return;
     }
     
-    /* Do the mmap for the second process using first process' mmap_addr */
-    len = info.len;
-    mmap_addr = mmap(info.mmap_addr, len, PROT_READ | PROT_WRITE,
+    mmap_addr = mmap(addr, len, PROT_READ | PROT_WRITE,
                 MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
     if (mmap_addr == MAP_FAILED)
             errExit("mmap failed");
     
-    msi_array = malloc(sizeof(char) * (len / page_size)); /* Allocate a char per page for MSI protocol */
-    for (char * ptr = msi_array; ptr < msi_array + (len / page_size); ptr++)
-        *ptr = INVALID;
-    
-    printf("-----------------------------------------------------\n");
-    printf("Second process\nmmap_address: %p size: %ld\n", mmap_addr, len);
+    init_page_arrays(pages);
     
-    /* Register the userfaultfd here for first process */
+    /* Register the userfaultfd here */
     struct uffdio_api uffdio_api;
     struct uffdio_register uffdio_register;
     
@@ -245,43 +786,108 @@ static void * second_process_receive(void * arg) {
         errExit("itctl-UFFDIO_REGISTER error");
     
     pthread_create(&thread_id, NULL, fault_handler_thread, (void *)uffd);
+}
+
+
+/* Used for second process only to receive handshake msg */
+static void * second_process_receive(void * arg) {
+    /* This thread will be handle the reading from socket for 2nd process */    
+    int bytes_read;
+    
+    struct init_info info;          /* Used for storing the bytes read from first process */
+    if ((bytes_read = read(accepted_socket, &info, sizeof(struct init_info))) < 0)
+        errExit("Read error");
+    else if (bytes_read == 0) {
+        printf("The connection was resetted by peer\n");
+        exit(EXIT_FAILURE);
+    }
+    
+    /* Do the mmap for the second process using first process' mmap_addr */
+    len = info.len;
+    map_region((char *)(uintptr_t)info.mmap_addr);
+    
+    /* Bootstrap: the region starts out as a copy of the leader's */
+    if (info.sync) {
+        struct sync_run run;
+        
+        memset(msi_array, SHARED, len / page_size);
+        for (;;) {
+            read_full(accepted_socket, &run, sizeof(run));
+            if (run.count == 0)
+                break;
+            if (run.first + run.count > len / page_size) {
+                printf("Bootstrap sync out of range\n");
+                exit(EXIT_FAILURE);
+            }
+            
+            char * data = malloc((size_t)run.count * page_size);
+            if (data == NULL)
+                errExit("malloc failed");
+            read_full(accepted_socket, data, (size_t)run.count * page_size);
+            install_pages(run.first, run.count, data);
+            free(data);
+        }
+    }
+    
+    printf("-----------------------------------------------------\n");
+    printf("Second process\nmmap_address: %p size: %ld\n", mmap_addr, len);
     
     /* Carry out the rest of the operation */
     pthread_exit(NULL);
 }
 
 
-/* A third thread solely for receiving messages */
+/* A third thread solely for receiving messages on the socket passed in arg */
 static void * server_thread(void * arg) {
+    int sock = (int)(long)arg;
     int bytes_write;
     int bytes_read;
     struct msg_request request; /* For storing message */
+    char * update_buffer = malloc(sizeof(char) * page_size);   /* Holds bytes of 'U' request */
     
     while (1) {
-        if ((bytes_read = read(accepted_socket, &request, sizeof(request))) < 0)
+        if ((bytes_read = read(sock, &request, sizeof(request))) < 0)
             errExit("Reading error");
         else if (bytes_read == 0) {
             printf("Connection resetted\n");
             exit(EXIT_FAILURE);
         }
         
+        /* Everything below indexes the region with it */
+        if (request.which_page < 0 || (unsigned long)request.which_page >= len / page_size) {
+            printf("Bad page %d in '%c' request\n", request.which_page, request.request_type);
+            exit(EXIT_FAILURE);
+        }
+        
+        if (request.request_type != 'U')
+            trace_event(TRACE_RECV, request.which_page, request.request_type, 0);
+        
         if (request.request_type == 'F') {
+            struct page_info * info = &page_array[request.which_page];
+            
+            /* Fetching right after we invalidated them, looks like a consumer */
+            if (msi_array[request.which_page] == MODIFIED &&
+                    info->policy == POLICY_ADAPTIVE && !info->update &&
+                    ++info->refetch >= PROMOTE_THRESHOLD) {
+                info->update = 1;
+                info->refetch = 0;
+            }
+            
             if (msi_array[request.which_page] == INVALID) {
                 /* My page is also invalid */
-                if ((bytes_write = write(accepted_socket, "0", 1)) < 0)
+                if ((bytes_write = write(sock, "0", 1)) < 0)
                     errExit("Writing error");
                 /* Set it to be shared */
                 msi_array[request.which_page] = SHARED;
             }
             else {
                 /* If the requested page is not invalid, just send it back */
-                if ((bytes_write = write(accepted_socket, "1", 1)) < 0)
+                if ((bytes_write = write(sock, "1", 1)) < 0)
                     errExit("Writing error");
                 
                 char * address_loc = mmap_addr + (request.which_page * page_size);
 
-                if ((bytes_write = write(accepted_socket, address_loc, page_size)) < 0)
-                    errExit("Writing error");
+                write_full(sock, address_loc, page_size);
                 /* And mark it as shared because both are the same now */
                 msi_array[request.which_page] = SHARED;
             }
@@ -293,6 +899,46 @@ static void * server_thread(void * arg) {
                 errExit("Madvise failed");
             msi_array[request.which_page] = INVALID;
             
+            if ((bytes_write = write(sock, "A", 1)) < 0)
+                errExit("Writing error");
+        }
+        else if (request.request_type == 'U') {
+            struct update_info update;
+            struct page_info * info = &page_array[request.which_page];
+            char * address_loc = mmap_addr + (request.which_page * page_size);
+            
+            read_full(sock, &update, sizeof(update));
+            /* The bytes go into a page sized buffer, anything outside of it can't be skipped safely */
+            if (update.offset < 0 || update.length <= 0 || update.length > page_size - update.offset) {
+                printf("Bad update of %d bytes at %d\n", update.length, update.offset);
+                exit(EXIT_FAILURE);
+            }
+            read_full(sock, update_buffer + update.offset, update.length);
+            trace_event(TRACE_RECV, request.which_page, 'U', update.length);
+            
+            if (msi_array[request.which_page] == INVALID && update.length == page_size)
+                install_pages(request.which_page, 1, update_buffer);     /* Page is not mapped here */
+            else
+                memcpy(address_loc + update.offset, update_buffer + update.offset, update.length);
+            msi_array[request.which_page] = SHARED;
+            
+            if ((bytes_write = write(sock, "A", 1)) < 0)
+                errExit("Writing error");
+            
+            /* Previous pushed copy got overwritten before anyone read it */
+            if (info->pushed && ++info->unread >= DEMOTE_THRESHOLD) {
+                sent_request('D', request.which_page);
+                info->unread = 0;
+            }
+            info->pushed = 1;
+        }
+        else if (request.request_type == 'D') {
+            /* Our pushes are wasted on this page, go back to invalidating */
+            struct page_info * info = &page_array[request.which_page];
+            if (info->policy == POLICY_ADAPTIVE) {
+                info->update = 0;
+                info->refetch = 0;
+            }
         }
     }
     
@@ -300,137 +946,324 @@ static void * server_thread(void * arg) {
 }
 
 
+/* Serves the fetches of our peer's s2dsm_kfast on listen port + S2DSM_KFAST_PORT_OFFSET */
+static void * kfast_server_thread(void * arg) {
+    int server_port = (int)(long)arg;
+    int sock = accept_one(server_port);
+    
+    return server_thread((void *)(long)sock);
+}
+
+
+/*
+ * Leader side of the bootstrap sync. Only the first preloaded_pages can
+ * hold data, everything else is still blank on both sides, so runs of
+ * non-blank pages among those are all that has to go over the socket.
+ */
+static void stream_region(void) {
+    struct sync_run run;
+    char * zero = calloc(1, page_size);
+    int i = 0;
+    
+    while (i < preloaded_pages) {
+        if (!memcmp(mmap_addr + (i * page_size), zero, page_size)) {
+            i++;
+            continue;
+        }
+        
+        run.first = i;
+        while (i < preloaded_pages && memcmp(mmap_addr + (i * page_size), zero, page_size))
+            i++;
+        run.count = i - run.first;
+        
+        write_full(connect_socket, &run, sizeof(run));
+        write_full(connect_socket, mmap_addr + (run.first * page_size), (size_t)run.count * page_size);
+    }
+    
+    run.first = 0;
+    run.count = 0;
+    write_full(connect_socket, &run, sizeof(run));
+    free(zero);
+}
+
+
+/* Fill the region from path on the leader before the sync streams it */
+static void preload_region(const char * path) {
+    int fd;
+    ssize_t bytes_read = 0;
+    size_t done = 0;
+    
+    if ((fd = open(path, O_RDONLY)) == -1)
+        errExit("Opening preload file failed");
+    
+    /* Pages are shared already, so faults here are resolved locally */
+    while (done < len && (bytes_read = read(fd, mmap_addr + done, len - done)) > 0)
+        done += bytes_read;
+    if (bytes_read < 0)
+        errExit("Reading preload file failed");
+    
+    close(fd);
+    preloaded_pages = (done + page_size - 1) / page_size;
+}
+
+
+/* Reads every reply the other process sends back on connect_socket */
+static void * reply_thread(void * arg) {
+    char response;
+    
+    while (1) {
+        read_full(connect_socket, &response, sizeof(response));
+        
+        pthread_mutex_lock(&reply_lock);
+        if (response == 'A')
+            acks_received++;
+        else {
+            /* Response to the outstanding 'F', '1' carries the page as well */
+            if (response == '1')
+                read_full(connect_socket, fetch_page, page_size);
+            fetch_response = response;
+        }
+        pthread_cond_broadcast(&reply_cond);
+        pthread_mutex_unlock(&reply_lock);
+    }
+    
+    pthread_exit(NULL);
+}
+
+
 int main(int argc, char ** argv) {
     struct sockaddr_in address_out;     /* Address of other process */
     int bytes_write;                    /* Used for write() */
-    int pages;                          /* Pages input from user */
+    int pages = 0;                      /* Pages input from user or -p */
     char pages_raw[50];                 /* Buffer for storing fgets for # pages */
     char * fgets_ret;                   /* fgets_ret */
     
     pthread_t thread_id;
-    pthread_t fault_thread_id;      /* fault handler id*/
+    pthread_t reply_thread_id;      /* connect_socket reader id */
     
     int pid_buffer;                 /* Storing current pid */
+    int opt;                        /* Used for getopt */
     
-    if (argc != 3) {
+    char * membership = NULL;       /* -m membership file, bootstrap mode */
+    int self_id = -1;               /* -n our member id */
+    char * preload = NULL;          /* -f file the leader fills the region from */
+    struct member members[MAX_MEMBERS];
+    
+    /* Time to ready, minus whatever the pages prompt waited on the user */
+    uint64_t boot_start = now_ns();
+    uint64_t connected;
+    uint64_t prompt_ns = 0;
+    
+    while ((opt = getopt(argc, argv, "t:km:n:p:f:")) != -1) {
+        errno = 0;
+        switch (opt) {
+            case 't':
+            /* Record a trace for s2dsm_sim */
+            if ((trace_file = fopen(optarg, "wb")) == NULL)
+                errExit("Opening trace failed");
+            break;
+            
+            case 'k':
+            /* Resolve faults in the kernel, needs s2dsm_kfast loaded on both sides and root */
+            if ((kfast_fd = open(S2DSM_KFAST_DEV, O_RDWR | O_CLOEXEC)) == -1)
+                errExit("Opening " S2DSM_KFAST_DEV " failed");
+            break;
+            
+            case 'm':
+            membership = optarg;
+            break;
+            
+            case 'n':
+            self_id = strtol(optarg, NULL, 10);
+            break;
+            
+            case 'p':
+            /* Skip the pages prompt */
+            pages = strtol(optarg, NULL, 10);
+            break;
+            
+            case 'f':
+            preload = optarg;
+            break;
+            
+            default:
+            printf("Usage: %s [-t trace_file] [-k] [-p pages] listen_port send_port\n"
+                    "       %s [-t trace_file] [-k] [-p pages] [-f preload_file] -m membership_file -n id\n",
+                    argv[0], argv[0]);
+            exit(EXIT_FAILURE);
+        }
+        if (errno)
+            errExit("Converting number failed");
+    }
+    
+    if (!membership && argc - optind != 2) {
         printf("You will need to specify 2 arguments!\n");
         exit(EXIT_FAILURE);
     }
-    
-    /* Parse the first number and second number */
-    errno = 0;
-    int * listen_port = malloc(sizeof(int));
-    *listen_port = strtol(argv[1], NULL, 0);
-    if (errno)
-        errExit("Converting number failed");
-    
-    errno = 0;
-    int * send_port = malloc(sizeof(int));
-    *send_port = strtol(argv[2], NULL, 0);
-    if (errno)
-        errExit("Converting number failed");
-    
-    if (listen_port == send_port) {
-        printf("Cannot be listening and sending to same port\n");
+    if (preload && !membership) {
+        printf("-f needs bootstrap mode (-m)\n");
         exit(EXIT_FAILURE);
     }
     
-    printf("Listening on port %d sending on port %d\n", *listen_port, *send_port);
-    
     page_size = sysconf(_SC_PAGE_SIZE);
     
-    /* Do the handshake that listen to establish who is first/second */
-    pthread_create(&thread_id, NULL, handshake, (void *) listen_port);
-    
-    /* Socket to connect to other thread */
-    connect_socket = socket(AF_INET, SOCK_STREAM, 0);
-    
-    address_out.sin_family = AF_INET;
-    address_out.sin_port = htons(*send_port);
-    
-    if(inet_pton(AF_INET, "127.0.0.1", &address_out.sin_addr) <= 0)
-        errExit("inet_pton failed");
-    
-    /* Client connect here to the other port */
-    while(connect(connect_socket, (struct sockaddr *)&address_out, sizeof(address_out)) < 0) {
-        // perror("Connection failed retrying");
-        sleep(1);
+    if (membership) {
+        struct member * self = NULL, * peer = NULL;
+        struct member pair[2];          /* Peer, then ourselves */
+        struct hello_info hello;
+        
+        if (read_members(membership, members) != MAX_MEMBERS) {
+            printf("%s: s2dsm needs exactly %d members\n", membership, MAX_MEMBERS);
+            exit(EXIT_FAILURE);
+        }
+        for (int i = 0; i < MAX_MEMBERS; i++) {
+            if (members[i].id == self_id)
+                self = &members[i];
+            else
+                peer = &members[i];
+        }
+        if (self == NULL) {
+            printf("%s: no member with id %d (-n)\n", membership, self_id);
+            exit(EXIT_FAILURE);
+        }
+        
+        printf("Member %d on port %d, peer %d at %s:%d\n", self->id, self->port,
+                peer->id, peer->host, peer->port);
+        peer_port = peer->port;
+        strcpy(peer_host, peer->host);
+        
+        if (kfast_fd != -1)
+            pthread_create(&thread_id, NULL, kfast_server_thread,
+                    (void *)(long)(self->port + S2DSM_KFAST_PORT_OFFSET));
+        
+        pair[0] = *peer;
+        pair[1] = *self;
+        pthread_create(&thread_id, NULL, member_handshake, pair);
+        
+        address_out.sin_family = AF_INET;
+        address_out.sin_port = htons(peer->port);
+        inet_pton(AF_INET, peer->host, &address_out.sin_addr);
+        connect_all(&address_out, &connect_socket, 1);
+        
+        hello.magic = HELLO_MAGIC;
+        hello.id = self->id;
+        write_full(connect_socket, &hello, sizeof(hello));
+        
+        pthread_join(thread_id, NULL);
+        
+        /* Same answer on every member, no need to exchange anything */
+        first_process = self->id < peer->id;
     }
+    else {
+        /* Parse the first number and second number */
+        errno = 0;
+        int * listen_port = malloc(sizeof(int));
+        *listen_port = strtol(argv[optind], NULL, 0);
+        if (errno)
+            errExit("Converting number failed");
+        
+        errno = 0;
+        int * send_port = malloc(sizeof(int));
+        *send_port = strtol(argv[optind + 1], NULL, 0);
+        if (errno)
+            errExit("Converting number failed");
+        
+        if (*listen_port == *send_port) {
+            printf("Cannot be listening and sending to same port\n");
+            exit(EXIT_FAILURE);
+        }
+        
+        printf("Listening on port %d sending on port %d\n", *listen_port, *send_port);
+        peer_port = *send_port;
+        
+        /* Peer's s2dsm_kfast connects here once it knows the region */
+        if (kfast_fd != -1)
+            pthread_create(&thread_id, NULL, kfast_server_thread,
+                    (void *)(long)(*listen_port + S2DSM_KFAST_PORT_OFFSET));
+        
+        /* Do the handshake that listen to establish who is first/second */
+        pthread_create(&thread_id, NULL, handshake, (void *) listen_port);
+        
+        address_out.sin_family = AF_INET;
+        address_out.sin_port = htons(*send_port);
+        
+        if(inet_pton(AF_INET, "127.0.0.1", &address_out.sin_addr) <= 0)
+            errExit("inet_pton failed");
+        
+        /* Client connect here to the other port */
+        connect_all(&address_out, &connect_socket, 1);
+        
+        /* Get current pid */
+        pid_buffer = getpid();
+        
+        /* Sending the current pid to the other thread. Will receive by handshake thread */
+        if ((bytes_write = write(connect_socket, &pid_buffer, sizeof(pid_t))) < 0)
+            errExit("Writing error");
+        
+        /* Wait for handshake to complete */
+        pthread_join(thread_id, NULL);
+    }
+    connected = now_ns();
     
-    /* Get current pid */
-    pid_buffer = getpid();
-    
-    /* Sending the current pid to the other thread. Will receive by handshake thread */
-    if ((bytes_write = write(connect_socket, &pid_buffer, sizeof(pid_t))) < 0)
-        errExit("Writing error");
-    
-    /* Wait for handshake to complete */
-    pthread_join(thread_id, NULL);
+    /* From here on only reply_thread reads connect_socket */
+    pthread_create(&reply_thread_id, NULL, reply_thread, NULL);
     
     /* Start the thread to receive the message if you're not the 1st process */    
     if (!first_process) {
         pthread_create(&thread_id, NULL, second_process_receive, NULL);
         pthread_join(thread_id, NULL);
-        pthread_create(&thread_id, NULL, server_thread, NULL);
+        pthread_create(&thread_id, NULL, server_thread, (void *)(long)accepted_socket);
     }
     else {
-        printf("> How many pages would you like to allocate (greater than 0)? ");
-        
         /* Big enough to store a pointer and an integer */
         struct init_info info;
         
-        if ((fgets_ret = fgets(pages_raw, MAX_SIZE, stdin)) < 0)
-            errExit("fgets failed");
-        
-        errno = 0;
-        pages = strtol(pages_raw, NULL, 10);
-        if (errno)
-            errExit("Converting number failed");
+        if (pages <= 0) {
+            uint64_t prompt_start = now_ns();
+            
+            printf("> How many pages would you like to allocate (greater than 0)? ");
+            if ((fgets_ret = fgets(pages_raw, MAX_SIZE, stdin)) < 0)
+                errExit("fgets failed");
+            
+            errno = 0;
+            pages = strtol(pages_raw, NULL, 10);
+            if (errno)
+                errExit("Converting number failed");
+            prompt_ns = now_ns() - prompt_start;
+        }
         
         len = page_size * pages;
+        map_region(NULL);
         
-        mmap_addr = mmap(NULL, len, PROT_READ | PROT_WRITE,
-                MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
-        if (mmap_addr == MAP_FAILED)
-            errExit("mmap failed");
-        
-        msi_array = malloc(sizeof(char) * pages); /* Allocate a char per page for MSI protocol */
-        for (char * ptr = msi_array; ptr < msi_array + (len / page_size); ptr++)
-            *ptr = INVALID;
+        /* Bootstrap: we own the initial contents, which the other side gets a copy of */
+        if (membership) {
+            memset(msi_array, SHARED, pages);
+            if (preload)
+                preload_region(preload);
+        }
         
         printf("-----------------------------------------------------\n");
         printf("First process\nmmap_address: %p size: %ld\n", mmap_addr, len);
         
         /* Write both mmap_address + len into struct */
-        info.mmap_addr = mmap_addr;
+        info.mmap_addr = (uintptr_t)mmap_addr;
         info.len = len;
+        info.sync = membership != NULL;
+        info.pad = 0;
         
         /* Send over as the first message after handshake*/
-        if ((bytes_write = write(connect_socket, &info, sizeof(struct init_info))) < 0)
-            errExit("Writing error");
-        
-        /* Register the userfaultfd here for first process */
-        struct uffdio_api uffdio_api;
-        struct uffdio_register uffdio_register;
-        long uffd;
-        
-        uffd = syscall(__NR_userfaultfd, O_CLOEXEC | O_NONBLOCK);
-        if (uffd == -1)
-            errExit("Userfaultfd error");
+        write_full(connect_socket, &info, sizeof(struct init_info));
+        if (membership)
+            stream_region();
         
-        uffdio_api.api = UFFD_API;
-        uffdio_api.features = 0;
-        if (ioctl(uffd, UFFDIO_API, &uffdio_api) == -1)
-            errExit("itctl-UFFDIO_API error");
-        
-        uffdio_register.range.start = (unsigned long) mmap_addr;
-        uffdio_register.range.len = len;
-        uffdio_register.mode = UFFDIO_REGISTER_MODE_MISSING;
-        if (ioctl(uffd, UFFDIO_REGISTER, &uffdio_register) == -1)
-            errExit("itctl-UFFDIO_REGISTER error");
-        
-        pthread_create(&fault_thread_id, NULL, fault_handler_thread, (void *)uffd);
-        pthread_create(&thread_id, NULL, server_thread, NULL);
+        pthread_create(&thread_id, NULL, server_thread, (void *)(long)accepted_socket);
+    }
+    
+    if (membership) {
+        uint64_t ready = now_ns();
+        printf("Ready in %.3f ms (connect %.3f ms, region %.3f ms)\n",
+                (ready - boot_start - prompt_ns) / 1e6, (connected - boot_start) / 1e6,
+                (ready - connected - prompt_ns) / 1e6);
     }
     
     printf("-----------------------------------------------------\n");
@@ -438,13 +1271,16 @@ int main(int argc, char ** argv) {
     /* Used for the while loop for reading userinput */
     char op[MAX_SIZE];              /* Storing user input for operation */
     char which_page_raw[MAX_SIZE];  /* Storing page input */
+    char policy_raw[MAX_SIZE];      /* Storing policy input */
+    char policy = POLICY_INVALIDATE;    /* Parsed of policy_raw */
     int which_page;                 /* Parsed of which_page_raw */
     char * msg = malloc(sizeof(char) * page_size);      /* Msg buffer for writing to page */
+    char * twin = malloc(sizeof(char) * page_size);     /* Old page contents for diffing */
     
     int max_page = (int)(len / page_size);
     
     while (1) {
-        printf("> Which command should I run? (r:read, w:write, v:view msi array): ");
+        printf("> Which command should I run? (r:read, w:write, v:view msi array, m:set write policy, s:fault stats): ");
         if ((fgets_ret = fgets(op, MAX_SIZE, stdin)) < 0)
             errExit("fgets failed");
         else if (fgets_ret == 0) {
@@ -452,8 +1288,23 @@ int main(int argc, char ** argv) {
         }
         op[strcspn(op, "\n")] = 0;
         
-        if (op[0] != 'r' && op[0] != 'w' && op[0] != 'v') {
-            printf("Invalid operation specified (r:read, w:write, v:view msi array)\n");
+        if (op[0] != 'r' && op[0] != 'w' && op[0] != 'v' && op[0] != 'm' && op[0] != 's') {
+            printf("Invalid operation specified (r:read, w:write, v:view msi array, m:set write policy, s:fault stats)\n");
+            continue;
+        }
+        else if (op[0] == 's') {
+            /* Same accesses either way, so the two paths can be compared */
+            print_stats("Accesses to invalid pages", access_stats.count,
+                    access_stats.total_ns, access_stats.max_ns);
+            if (kfast_fd != -1) {
+                struct s2dsm_kfast_stats stats;
+                if (ioctl(kfast_fd, S2DSM_KFAST_STATS, &stats) == -1)
+                    errExit("ioctl-S2DSM_KFAST_STATS error");
+                print_stats("Faults resolved by s2dsm_kfast", stats.faults, stats.total_ns, stats.max_ns);
+            }
+            else
+                print_stats("Faults resolved by uffd handler", handler_stats.count,
+                        handler_stats.total_ns, handler_stats.max_ns);
             continue;
         }
         else if (op[0] == 'w') {
@@ -465,20 +1316,41 @@ int main(int argc, char ** argv) {
             }
             msg[strcspn(msg, "\n")] = 0;
         }
+        else if (op[0] == 'm') {
+            printf("> Which policy? (i:invalidate, u:update, a:adaptive): ");
+            if ((fgets_ret = fgets(policy_raw, MAX_SIZE, stdin)) < 0)
+                errExit("fgets failed");
+            else if (fgets_ret == 0)
+                break;
+            
+            if (policy_raw[0] == 'i')
+                policy = POLICY_INVALIDATE;
+            else if (policy_raw[0] == 'u')
+                policy = POLICY_UPDATE;
+            else if (policy_raw[0] == 'a')
+                policy = POLICY_ADAPTIVE;
+            else {
+                printf("Invalid policy specified (i:invalidate, u:update, a:adaptive)\n");
+                continue;
+            }
+        }
         else if (op[0] == 'v') {
             /* Print out all MSI array */
             for (int i=0;i < max_page;i++) {
+                const char * policy_s = page_array[i].policy == POLICY_UPDATE ? POLICY_UPDATE_S :
+                    page_array[i].policy == POLICY_ADAPTIVE ? POLICY_ADAPTIVE_S : POLICY_INVALIDATE_S;
+                
                 switch (msi_array[i]) {
                     case INVALID:
-                    printf("  [*]  Page %d:\n%s\n", i, INVALID_S);
+                    printf("  [*]  Page %d:\n%s (%s)\n", i, INVALID_S, policy_s);
                     break;
                     
                     case SHARED:
-                    printf("  [*]  Page %d:\n%s\n", i, SHARED_S);
+                    printf("  [*]  Page %d:\n%s (%s)\n", i, SHARED_S, policy_s);
                     break;
                     
                     case MODIFIED:
-                    printf("  [*]  Page %d:\n%s\n", i, MODIFIED_S);
+                    printf("  [*]  Page %d:\n%s (%s)\n", i, MODIFIED_S, policy_s);
                     break;
                     
                     default:
@@ -503,41 +1375,42 @@ int main(int argc, char ** argv) {
             continue;
         }
         
-        if (which_page == -1) {
-            /* Print out everything */
-            for (int i=0;i<max_page;i++) {
-                char * address_loc = mmap_addr + (i * page_size);
-                
-                if (op[0] == 'r') {
-                    char page_buffer[page_size];
-                    strncpy(page_buffer, address_loc, page_size);  /* Will trigger page-fault on initial read */
-                    printf("  [*]  Page %d:\n%s\n", i, address_loc);
-                }
-                else {
-                    strncpy(address_loc, msg, page_size);
-                    msi_array[i] = MODIFIED;
-                    printf("  [*]  Page %d:\n%s\n", i, address_loc);
-                    
-                    sent_request('I', i);
-                }
-            }
-        }
-        else {
-            char * address_loc = mmap_addr + (which_page * page_size);
+        /* -1 means every page, otherwise just the one */
+        int start = which_page == -1 ? 0 : which_page;
+        int end = which_page == -1 ? max_page : which_page + 1;
+        
+        for (int i = start; i < end; i++) {
+            char * address_loc = mmap_addr + (i * page_size);
             
             if (op[0] == 'r') {
                 char page_buffer[page_size];
+                int fetching = msi_array[i] == INVALID;
+                uint64_t start = now_ns();
+                
+                trace_event(TRACE_READ, i, msi_array[i], 0);
                 strncpy(page_buffer, address_loc, page_size);  /* Will trigger page-fault on initial read */
-                printf("  [*]  Page %d:\n%s\n", which_page, page_buffer);
+                if (fetching)
+                    account(&access_stats, now_ns() - start);
+                printf("  [*]  Page %d:\n%s\n", i, page_buffer);
+                
+                /* Whatever got pushed to us was worth it */
+                page_array[i].pushed = 0;
+                page_array[i].unread = 0;
+            }
+            else if (op[0] == 'w') {
+                write_page(i, msg, twin);
+                printf("  [*]  Page %d:\n%s\n", i, address_loc);
             }
             else {
-                strncpy(address_loc, msg, page_size);
-                msi_array[which_page] = MODIFIED;
-                printf("  [*]  Page %d:\n%s\n", which_page, address_loc);
-                
-                sent_request('I', which_page);
+                page_array[i].policy = policy;
+                page_array[i].update = policy == POLICY_UPDATE;
+                page_array[i].refetch = 0;
             }
         }
+        
+        /* Invalidations and updates went out pipelined, wait for all of them once */
+        if (op[0] == 'w')
+            fence();
     }
     return 0;
 }
\ No newline at end of file
@@ -0,0 +1,524 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <errno.h>
+#include <unistd.h>
+#include <string.h>
+#include <stdint.h>
+#include "s2dsm_trace.h"
+
+#define MAX_NODES 8
+#define PROMOTE_THRESHOLD 2     /* Same as s2dsm_P2.c */
+#define DEMOTE_THRESHOLD 2      /* Same as s2dsm_P2.c */
+#define errExit(str) do { \
+    perror(str); \
+    exit(EXIT_FAILURE); \
+} while(0)
+
+#define MODIFIED 1
+#define SHARED 2
+#define INVALID 3
+#define EXCLUSIVE 4
+
+/*
+ * Offline replay of s2dsm traces. The reads and writes recorded by
+ * every process are merged by timestamp and replayed against a set
+ * of coherence protocol models, each of which counts the messages
+ * it would have needed and estimates the time spent waiting on them.
+ * Faults and requests in the traces are only used to report what
+ * the live run actually did next to the models.
+ */
+
+/* One local read or write taken from a trace */
+struct access {
+    uint64_t ts;
+    int node;
+    int page;
+    int write;
+    int len;                    /* Bytes written */
+};
+
+/* Knobs shared by every model */
+struct sim_config {
+    int block_pages;            /* Pages per coherence block */
+    int prefetch;               /* Extra blocks piggybacked on every fetch */
+    double latency;             /* One way message latency in us */
+    double bandwidth;           /* Bytes per us */
+    int page_size;
+    int pages;
+    int nodes;
+};
+
+struct sim_stats {
+    unsigned long misses;       /* Accesses that had to go remote */
+    unsigned long fetches;      /* Fetch requests */
+    unsigned long replies;      /* Responses to fetches */
+    unsigned long invalidations;
+    unsigned long updates;
+    unsigned long acks;
+    unsigned long hints;        /* Adaptive demote hints */
+    unsigned long bytes;        /* Page data moved */
+    double stall;               /* Estimated time accesses waited, in us */
+};
+
+/* Adaptive bookkeeping for a block, mirrors struct page_info in s2dsm_P2.c */
+struct block_info {
+    char update;
+    unsigned char refetch;
+    unsigned char unread[MAX_NODES];
+    char pushed[MAX_NODES];
+};
+
+struct sim {
+    struct sim_config * config;
+    struct sim_stats stats;
+    int blocks;
+    char * state;               /* state[node * blocks + block] */
+    struct block_info * info;   /* One per block */
+    int fence_node;             /* Node whose writes are being pipelined into one fence, -1 if none */
+};
+
+/* A protocol model, the replay calls read/write for every access */
+struct protocol {
+    const char * name;
+    const char * description;
+    void (*read)(struct sim * sim, int node, int block);
+    void (*write)(struct sim * sim, int node, int block, int len);
+};
+
+
+static char * state_of(struct sim * sim, int node, int block) {
+    return &sim->state[node * sim->blocks + block];
+}
+
+
+static int block_bytes(struct sim * sim) {
+    return sim->config->block_pages * sim->config->page_size;
+}
+
+
+/* Request followed by a response carrying bytes */
+static void round_trip(struct sim * sim, int bytes) {
+    sim->stats.stall += 2 * sim->config->latency + bytes / sim->config->bandwidth;
+}
+
+
+/*
+ * Charge the ack round trip of a write that needed remote work. Writes
+ * by one node in a row are pipelined and only wait once at the fence.
+ */
+static void write_fence(struct sim * sim, int node, int bytes) {
+    if (sim->fence_node != node) {
+        sim->stats.stall += 2 * sim->config->latency;
+        sim->fence_node = node;
+    }
+    sim->stats.stall += bytes / sim->config->bandwidth;
+}
+
+
+/* Find another node holding a valid copy, owners first */
+static int find_holder(struct sim * sim, int node, int block) {
+    int sharer = -1;
+    
+    for (int i = 0; i < sim->config->nodes; i++) {
+        if (i == node)
+            continue;
+        char state = *state_of(sim, i, block);
+        if (state == MODIFIED || state == EXCLUSIVE)
+            return i;
+        if (state == SHARED && sharer == -1)
+            sharer = i;
+    }
+    return sharer;
+}
+
+
+/* Pull one block into node, downgrading whoever owned it */
+static int pull_block(struct sim * sim, int node, int block) {
+    int holder = find_holder(sim, node, block);
+    
+    if (holder != -1) {
+        char * state = state_of(sim, holder, block);
+        if (*state == MODIFIED || *state == EXCLUSIVE)
+            *state = SHARED;
+    }
+    *state_of(sim, node, block) = SHARED;
+    return holder;
+}
+
+
+/*
+ * Miss on block: one request and one response. The response carries
+ * the block if anyone has it, plus up to prefetch following blocks
+ * that are invalid here. Returns the node that had the block or -1.
+ */
+static int fetch(struct sim * sim, int node, int block) {
+    int holder;
+    int bytes = 0;
+    
+    sim->stats.misses++;
+    sim->stats.fetches++;
+    sim->stats.replies++;
+    
+    holder = pull_block(sim, node, block);
+    if (holder != -1)
+        bytes += block_bytes(sim);
+    
+    for (int i = 1; i <= sim->config->prefetch && block + i < sim->blocks; i++) {
+        if (*state_of(sim, node, block + i) != INVALID)
+            continue;
+        if (pull_block(sim, node, block + i) != -1)
+            bytes += block_bytes(sim);
+    }
+    
+    sim->stats.bytes += bytes;
+    round_trip(sim, bytes);
+    return holder;
+}
+
+
+/* Invalidate every other valid copy, each one acked */
+static void invalidate_others(struct sim * sim, int node, int block) {
+    int sent = 0;
+    
+    for (int i = 0; i < sim->config->nodes; i++) {
+        char * state = state_of(sim, i, block);
+        if (i == node || *state == INVALID)
+            continue;
+        *state = INVALID;
+        sim->stats.invalidations++;
+        sim->stats.acks++;
+        sent++;
+    }
+    if (sent)
+        write_fence(sim, node, 0);
+}
+
+
+/* Push the written bytes to every other node, each one acked */
+static void update_others(struct sim * sim, int node, int block, int len) {
+    struct block_info * info = &sim->info[block];
+    int bytes = 0;
+    
+    for (int i = 0; i < sim->config->nodes; i++) {
+        char * state = state_of(sim, i, block);
+        if (i == node)
+            continue;
+        
+        /* Invalid copies need the whole block, valid ones only the diff */
+        bytes += *state == INVALID ? block_bytes(sim) : len;
+        *state = SHARED;
+        sim->stats.updates++;
+        sim->stats.acks++;
+        
+        /* Last push to this node was never read */
+        if (info->pushed[i] && ++info->unread[i] >= DEMOTE_THRESHOLD) {
+            sim->stats.hints++;
+            info->unread[i] = 0;
+            info->update = 0;
+        }
+        info->pushed[i] = 1;
+    }
+    sim->stats.bytes += bytes;
+    write_fence(sim, node, bytes);
+}
+
+
+static void msi_read(struct sim * sim, int node, int block) {
+    if (*state_of(sim, node, block) == INVALID)
+        fetch(sim, node, block);
+}
+
+
+static void msi_write(struct sim * sim, int node, int block, int len) {
+    char * state = state_of(sim, node, block);
+    
+    if (*state == INVALID)
+        fetch(sim, node, block);
+    if (*state != MODIFIED)
+        invalidate_others(sim, node, block);
+    *state = MODIFIED;
+}
+
+
+/* Like MSI, but a miss nobody else holds comes back exclusive */
+static void mesi_read(struct sim * sim, int node, int block) {
+    if (*state_of(sim, node, block) == INVALID && fetch(sim, node, block) == -1)
+        *state_of(sim, node, block) = EXCLUSIVE;
+}
+
+
+/* Writing an exclusive block needs no messages */
+static void mesi_write(struct sim * sim, int node, int block, int len) {
+    char * state = state_of(sim, node, block);
+    
+    mesi_read(sim, node, block);
+    if (*state == SHARED)
+        invalidate_others(sim, node, block);
+    *state = MODIFIED;
+}
+
+
+static void update_read(struct sim * sim, int node, int block) {
+    msi_read(sim, node, block);
+    sim->info[block].pushed[node] = 0;
+    sim->info[block].unread[node] = 0;
+}
+
+
+static void update_write(struct sim * sim, int node, int block, int len) {
+    if (*state_of(sim, node, block) == INVALID)
+        fetch(sim, node, block);
+    update_others(sim, node, block, len);
+    *state_of(sim, node, block) = SHARED;
+}
+
+
+/* s2dsm's adaptive policy, start invalidating and switch on fetch/read behavior */
+static void adaptive_read(struct sim * sim, int node, int block) {
+    struct block_info * info = &sim->info[block];
+    
+    if (*state_of(sim, node, block) == INVALID) {
+        int holder = find_holder(sim, node, block);
+        
+        /* Fetching right behind the writer's invalidation */
+        if (holder != -1 && *state_of(sim, holder, block) == MODIFIED &&
+                !info->update && ++info->refetch >= PROMOTE_THRESHOLD) {
+            info->update = 1;
+            info->refetch = 0;
+        }
+        fetch(sim, node, block);
+    }
+    info->pushed[node] = 0;
+    info->unread[node] = 0;
+}
+
+
+static void adaptive_write(struct sim * sim, int node, int block, int len) {
+    struct block_info * info = &sim->info[block];
+    char * state = state_of(sim, node, block);
+    
+    if (info->update) {
+        update_write(sim, node, block, len);
+        return;
+    }
+    if (*state == MODIFIED)
+        info->refetch = 0;
+    msi_write(sim, node, block, len);
+}
+
+
+static const struct protocol protocols[] = {
+    { "msi", "invalidate on write", msi_read, msi_write },
+    { "mesi", "msi with exclusive state", mesi_read, mesi_write },
+    { "update", "push writes to every copy", update_read, update_write },
+    { "adaptive", "s2dsm adaptive update/invalidate", adaptive_read, adaptive_write },
+};
+
+
+/* Replay every access against one protocol */
+static void run(const struct protocol * protocol, struct sim_config * config,
+        struct access * accesses, int count) {
+    struct sim sim;
+    
+    memset(&sim, 0, sizeof(sim));
+    sim.config = config;
+    sim.blocks = (config->pages + config->block_pages - 1) / config->block_pages;
+    sim.state = malloc(config->nodes * sim.blocks);
+    sim.info = calloc(sim.blocks, sizeof(struct block_info));
+    if (sim.state == NULL || sim.info == NULL)
+        errExit("malloc failed");
+    memset(sim.state, INVALID, config->nodes * sim.blocks);
+    sim.fence_node = -1;
+    
+    for (int i = 0; i < count; i++) {
+        struct access * a = &accesses[i];
+        int block = a->page / config->block_pages;
+        
+        /* Anything but another write by the fencing node ends its pipeline */
+        if (!a->write || a->node != sim.fence_node)
+            sim.fence_node = -1;
+        
+        if (a->write)
+            protocol->write(&sim, a->node, block, a->len);
+        else
+            protocol->read(&sim, a->node, block);
+    }
+    
+    printf("%-9s %7lu %7lu %7lu %7lu %7lu %7lu %7lu %9lu %9.1f %12.3f\n",
+            protocol->name, sim.stats.misses, sim.stats.fetches, sim.stats.replies,
+            sim.stats.invalidations, sim.stats.updates, sim.stats.acks, sim.stats.hints,
+            sim.stats.fetches + sim.stats.replies + sim.stats.invalidations +
+            sim.stats.updates + sim.stats.acks + sim.stats.hints,
+            sim.stats.bytes / 1024.0, sim.stats.stall / 1000.0);
+    
+    free(sim.state);
+    free(sim.info);
+}
+
+
+static int compare_access(const void * a, const void * b) {
+    const struct access * x = a, * y = b;
+    if (x->ts != y->ts)
+        return x->ts < y->ts ? -1 : 1;
+    return x->node - y->node;
+}
+
+
+static void usage(char * name) {
+    printf("Usage: %s [-p protocol] [-b block_pages] [-f prefetch_blocks] "
+            "[-l latency_us] [-w bandwidth_MBps] trace_file...\n", name);
+    printf("Protocols:");
+    for (unsigned long i = 0; i < sizeof(protocols) / sizeof(protocols[0]); i++)
+        printf(" %s (%s)%s", protocols[i].name, protocols[i].description,
+                i + 1 < sizeof(protocols) / sizeof(protocols[0]) ? "," : "\n");
+    exit(EXIT_FAILURE);
+}
+
+
+int main(int argc, char ** argv) {
+    struct sim_config config = { 1, 0, 25.0, 1000.0, 0, 0, 0 };
+    char * protocol_name = NULL;        /* NULL runs all of them */
+    struct access * accesses = NULL;
+    int count = 0, capacity = 0;
+    int reads = 0, writes = 0;
+    
+    /* What the live processes did */
+    unsigned long faults = 0, fault_us = 0, fences = 0, fence_us = 0;
+    unsigned long sent[256] = { 0 };
+    int opt;
+    
+    while ((opt = getopt(argc, argv, "p:b:f:l:w:")) != -1) {
+        errno = 0;
+        switch (opt) {
+            case 'p':
+            protocol_name = optarg;
+            break;
+            
+            case 'b':
+            config.block_pages = strtol(optarg, NULL, 10);
+            break;
+            
+            case 'f':
+            config.prefetch = strtol(optarg, NULL, 10);
+            break;
+            
+            case 'l':
+            config.latency = strtod(optarg, NULL);
+            break;
+            
+            case 'w':
+            config.bandwidth = strtod(optarg, NULL);
+            break;
+            
+            default:
+            usage(argv[0]);
+        }
+        if (errno)
+            errExit("Converting number failed");
+    }
+    
+    if (optind == argc || config.block_pages < 1 || config.prefetch < 0 ||
+            config.latency < 0 || config.bandwidth <= 0)
+        usage(argv[0]);
+    
+    if (protocol_name) {
+        unsigned long i;
+        for (i = 0; i < sizeof(protocols) / sizeof(protocols[0]); i++)
+            if (!strcmp(protocol_name, protocols[i].name))
+                break;
+        if (i == sizeof(protocols) / sizeof(protocols[0]))
+            usage(argv[0]);
+    }
+    
+    for (int i = optind; i < argc; i++) {
+        struct trace_header header;
+        struct trace_record record;
+        FILE * file;
+        
+        if ((file = fopen(argv[i], "rb")) == NULL)
+            errExit("Opening trace failed");
+        
+        if (fread(&header, sizeof(header), 1, file) != 1 ||
+                header.magic != TRACE_MAGIC || header.version != TRACE_VERSION) {
+            printf("%s is not a s2dsm trace\n", argv[i]);
+            exit(EXIT_FAILURE);
+        }
+        if (header.node >= MAX_NODES) {
+            printf("%s: node %d, at most %d nodes supported\n", argv[i], header.node, MAX_NODES);
+            exit(EXIT_FAILURE);
+        }
+        if (config.page_size && (config.page_size != header.page_size || config.pages != header.pages)) {
+            printf("%s: region does not match the other traces\n", argv[i]);
+            exit(EXIT_FAILURE);
+        }
+        config.page_size = header.page_size;
+        config.pages = header.pages;
+        if (header.node + 1 > config.nodes)
+            config.nodes = header.node + 1;
+        
+        while (fread(&record, sizeof(record), 1, file) == 1) {
+            switch (record.event) {
+                case TRACE_READ:
+                case TRACE_WRITE:
+                if (record.page >= header.pages)
+                    break;
+                if (count == capacity) {
+                    capacity = capacity ? capacity * 2 : 1024;
+                    if ((accesses = realloc(accesses, capacity * sizeof(struct access))) == NULL)
+                        errExit("realloc failed");
+                }
+                accesses[count].ts = record.ts;
+                accesses[count].node = header.node;
+                accesses[count].page = record.page;
+                accesses[count].write = record.event == TRACE_WRITE;
+                accesses[count].len = record.len;
+                count++;
+                record.event == TRACE_WRITE ? writes++ : reads++;
+                break;
+                
+                case TRACE_FAULT:
+                faults++;
+                fault_us += record.len;
+                break;
+                
+                case TRACE_SEND:
+                sent[record.arg]++;
+                break;
+                
+                case TRACE_FENCE:
+                fences++;
+                fence_us += record.len;
+                break;
+                
+                default:
+                break;
+            }
+        }
+        fclose(file);
+    }
+    
+    qsort(accesses, count, sizeof(struct access), compare_access);
+    
+    printf("Traces: %d, nodes: %d, region: %d pages of %d bytes\n",
+            argc - optind, config.nodes, config.pages, config.page_size);
+    printf("Accesses: %d (%d reads, %d writes)\n", count, reads, writes);
+    printf("Observed: %lu faults (avg %.1f us), %lu fences (avg %.1f us), "
+            "sent F %lu, I %lu, U %lu, D %lu\n",
+            faults, faults ? (double)fault_us / faults : 0.0,
+            fences, fences ? (double)fence_us / fences : 0.0,
+            sent['F'], sent['I'], sent['U'], sent['D']);
+    printf("Model: block %d page(s), prefetch %d block(s), latency %.1f us, bandwidth %.0f MB/s\n\n",
+            config.block_pages, config.prefetch, config.latency, config.bandwidth);
+    
+    printf("%-9s %7s %7s %7s %7s %7s %7s %7s %9s %9s %12s\n", "protocol", "misses",
+            "fetch", "reply", "inval", "update", "ack", "hint", "messages", "KB", "stall (ms)");
+    
+    for (unsigned long i = 0; i < sizeof(protocols) / sizeof(protocols[0]); i++) {
+        if (protocol_name && strcmp(protocol_name, protocols[i].name))
+            continue;
+        run(&protocols[i], &config, accesses, count);
+    }
+    
+    free(accesses);
+    return 0;
+}
@@ -0,0 +1,39 @@
+#ifndef S2DSM_TRACE_H
+#define S2DSM_TRACE_H
+
+#include <stdint.h>
+
+/*
+ * Binary trace written by s2dsm -t and read back by s2dsm_sim.
+ * A trace is one trace_header followed by trace_records until EOF.
+ * Timestamps are CLOCK_MONOTONIC so traces of processes on the same
+ * host can be merged by timestamp.
+ */
+#define TRACE_MAGIC 0x52543253      /* "S2TR" */
+#define TRACE_VERSION 1
+
+/* Values of trace_record.event */
+#define TRACE_READ 'r'      /* Local read of a page, arg = msi state before */
+#define TRACE_WRITE 'w'     /* Local write of a page, arg = msi state before, len = bytes written */
+#define TRACE_FAULT 'f'     /* Page fault resolved, arg = msi state at fault, len = service time in us */
+#define TRACE_SEND 's'      /* Request sent, arg = request type, len = payload bytes */
+#define TRACE_RECV 'v'      /* Request received, arg = request type, len = payload bytes */
+#define TRACE_FENCE 'n'     /* Writer fenced, len = time waited in us */
+
+struct trace_header {
+    uint32_t magic;         /* TRACE_MAGIC */
+    uint16_t version;       /* TRACE_VERSION */
+    uint16_t node;          /* 0 for the first process, 1 for the second */
+    uint32_t page_size;
+    uint32_t pages;
+};
+
+struct trace_record {
+    uint64_t ts;            /* CLOCK_MONOTONIC in ns */
+    uint32_t page;          /* Which page the event is about */
+    uint8_t event;          /* TRACE_* */
+    uint8_t arg;            /* Depends on event */
+    uint16_t len;           /* Depends on event, saturates at UINT16_MAX */
+};
+
+#endif
@@ -3,24 +3,190 @@
 #include <linux/seq_file.h>
 #include <linux/kprobes.h>
 #include <linux/hashtable.h>
-#include <linux/rbtree.h>
 #include <linux/slab.h>
+#include <linux/percpu.h>
+#include <linux/spinlock.h>
+#include <linux/sched.h>
+#include <linux/tracepoint.h>
+#include <linux/version.h>
+#include <linux/string.h>
+#include <linux/uaccess.h>
+#include <linux/sort.h>
+#include <linux/math64.h>
+#include <linux/hrtimer.h>
+#include <linux/stacktrace.h>
+#include <linux/jhash.h>
+#include <linux/mutex.h>
+#include <linux/smp.h>
+#include <linux/mm.h>
+#include <linux/vmalloc.h>
+#include <linux/hash.h>
+#include <linux/log2.h>
+#include <linux/timekeeping.h>
+#include <linux/miscdevice.h>
+#include <linux/fs.h>
+#include <linux/atomic.h>
+#include <linux/jiffies.h>
+#include <linux/cgroup.h>
+#include <linux/rcupdate.h>
+#include <linux/rhashtable.h>
+#include <linux/irq_work.h>
+#include <linux/workqueue.h>
+#include <linux/seqlock.h>
+#include <linux/random.h>
+#include <linux/prandom.h>
+#include <linux/topology.h>
+#include <linux/overflow.h>
+#include <asm/irq_regs.h>
+#include <asm/tsc.h>
 #include <asm/msr.h>
+#include "perftop_ring.h"
 
 #define DRIVER_AUTHOR "Ricky Lu ricky.lu@stonybrook.edu"
 #define DRIVER_DESC   "Homework 4 - CPU Profiler"
 #define UNSIGN_LONG_NULL (unsigned long)NULL
 
 static char func_name[NAME_MAX] = "pick_next_task_fair";    /* String that host the function to probe */
-static int pre_count;   /* Counting entry */
-static int post_count;  /* Counting return */
-static int context_switch_counter;  /* Counting number of context switches*/
-static struct hash_table_wrapper * ht_wrapper;  /* Used for storing the global hashtable */
-static struct rb_root mytree = RB_ROOT;         /* Used for storing the task ordered by total tsc */
+static char backend[16] = "tracepoint";     /* Which backend to try first, see perftop_init */
+static int use_tracepoint;                  /* Set if the sched_switch tracepoint is attached */
+static struct tracepoint * sched_switch_tp; /* Found by name, sched_switch isn't exported to modules */
+static struct perftop_cpu __percpu * perftop_cpus;     /* Per-CPU counters and task tables */
+static struct kmem_cache * task_cache;      /* Where every my_hash_table_struct comes from */
+static struct kmem_cache * group_cache;     /* Where every group_entry comes from */
+static struct tracepoint * sched_wakeup_tp, * sched_wakeup_new_tp;
+static int wakeup_attached;                 /* Set if both wakeup tracepoints are attached */
+static struct tracepoint * sched_process_exit_tp;
+static int exit_attached;                   /* Set if exited tasks are reclaimed */
+#if defined(CONFIG_CGROUPS) && LINUX_VERSION_CODE >= KERNEL_VERSION(5, 5, 0)
+static struct tracepoint * cgroup_rmdir_tp;
+static int rmdir_attached;                  /* Set if removed cgroups are reclaimed */
+#endif
+static struct tracepoint * sched_migrate_task_tp;
+static int migrate_attached;                /* Set if migrations are counted */
+static unsigned long loaded_at;             /* jiffies at load, migration rates are since then */
+static int max_tasks = 16384;               /* Most task entries over all CPUs before evicting */
+static atomic_t tracked_tasks = ATOMIC_INIT(0);     /* Task entries over all CPUs */
+static int max_groups = 4096;               /* Most process and cgroup entries over all CPUs */
+static atomic_t tracked_groups = ATOMIC_INIT(0);    /* Group entries over all CPUs */
 
-DEFINE_SPINLOCK(pre_count_lock);
-DEFINE_SPINLOCK(post_count_lock);
-DEFINE_SPINLOCK(post_timing_lock);      /* One lock to incorporate all of prev != next */
+#define MAX_SAMPLE_EVERY 1000   /* Sparsest switch sampling allowed */
+#define VAR_SHIFT 12            /* Variances are kept in (tsc >> VAR_SHIFT)^2 so they fit in 64 bits */
+#define SPARE_ENTRIES 64        /* Task and group entries each CPU keeps ready for its switch path */
+
+static int sample_every = 1;                /* Account 1 in this many switches per CPU, set with sample_every=<n> */
+
+static int ring_kb = 256;               /* Size of each CPU's event ring */
+static void * ring_area;                /* What /dev/perftop maps, allocated on first open */
+static u32 ring_events;                 /* Events per CPU, a power of 2 */
+static unsigned long ring_stride;       /* Bytes per CPU in ring_area */
+static atomic_t ring_users = ATOMIC_INIT(0);    /* Events are only written while someone has it open */
+static DEFINE_MUTEX(ring_mutex);        /* Serializes allocating ring_area */
+
+#define MAX_TOP_K 1000          /* Most tasks /proc/perftop will list */
+
+/* What the top list is ordered by, set by writing sort=<name> to /proc/perftop */
+enum sort_key {
+    SORT_TSC,                   /* Total tsc */
+    SORT_SWITCHES,              /* Slices run */
+    SORT_AVG,                   /* Total tsc per slice */
+    SORT_LOAD,                  /* Decayed load */
+    SORT_KEYS
+};
+static const char * const sort_names[SORT_KEYS] = { "tsc", "switches", "avg", "load" };
+static int top_k = 10;                  /* How many tasks to list, set with k=<n> */
+static int sort_key = SORT_TSC;
+
+#define WINDOW_SLOTS 64         /* One slot per second, enough for the longest window */
+#define WINDOW_SHIFT 10         /* Slots hold tsc >> WINDOW_SHIFT, so a whole second fits in 32 bits */
+#define LOAD_DECAY 59299        /* 65536 * e^(-1/10), a second's weight in the load relative to the next one */
+
+/* Rolling windows tsc can be shown for, set with window=<name>. 0 is since load */
+static const char * const window_names[] = { "all", "1s", "10s", "60s" };
+static const int window_lengths[] = { 0, 1, 10, 60 };
+static int window_secs;                 /* Length of the window shown, 0 for all of it */
+static u32 load_decay[WINDOW_SLOTS];    /* Weight of a slot by age, 65536 * e^(-age/10) */
+static u64 load_decay_total;            /* Sum of the weights of full seconds */
+
+#define MAX_SAMPLE_HZ 1000      /* Fastest the stack sampler may run */
+#define STACK_DEPTH 32          /* Frames kept of each of the kernel and user stack */
+#define STACK_POOL_SIZE 2048    /* Distinct stacks each CPU can keep */
+
+static int sample_hz;                   /* Stack sampling rate per CPU, 0 when off */
+static u64 sample_period_ns;            /* NSEC_PER_SEC / sample_hz */
+static struct sampler_cpu __percpu * sampler_cpus;
+static DEFINE_MUTEX(sampler_mutex);     /* Held while starting/stopping the sampler or reading its pools */
+
+#define OFFCPU_POOL_SIZE 4096   /* Distinct blocking stacks each CPU can keep */
+
+static int offcpu;                      /* Set with offcpu=1, charges blocked time to kernel stacks */
+static struct offcpu_cpu __percpu * offcpu_cpus;
+static struct offcpu_stamp * offcpu_stamps;     /* 1 << STAMP_BITS slots, like task_stamps */
+static DEFINE_MUTEX(offcpu_mutex);      /* Held while starting/stopping off-CPU profiling or reading it */
+
+#define WAKE_EDGES 1024         /* Distinct waker -> wakee edges each CPU can keep */
+
+static int wakegraph;                   /* Set with wakegraph=1, wakeups are aggregated by waker and wakee */
+static DEFINE_MUTEX(wakegraph_mutex);   /* Held while starting/stopping the wakeup graph or reading it */
+
+#define MAX_FUNCS 16            /* Most functions profiled at once */
+
+static char funcs[256];                 /* Comma separated functions being profiled, set with funcs=<list> */
+static struct func_probe * func_probes[MAX_FUNCS];
+static int nr_func_probes;
+static DEFINE_MUTEX(funcs_mutex);       /* Held while changing or reading func_probes */
+
+#define LOCK_SITES 512          /* Distinct contended call sites each CPU can keep */
+#define LOCK_SITE_DEPTH 4       /* Frames kept above the slow path, the lock call and its callers */
+
+static int locks;                       /* Set with locks=1, lock slow paths are probed */
+static struct lock_probe * lock_probes; /* One per entry of lock_funcs */
+static struct lock_cpu __percpu * lock_cpus;
+static DEFINE_MUTEX(locks_mutex);       /* Held while starting/stopping the lock probes or reading them */
+
+/* Not exported, looked up at load. NULL leaves samples without user frames */
+static unsigned int (*save_user_stack)(unsigned long * store, unsigned int size);
+
+#define LAT_BUCKETS 32          /* log2 ns buckets, the last one takes everything from ~1s up */
+#define STAMP_BITS 16           /* task_stamps has 1 << STAMP_BITS slots */
+
+/* How far a migrated task moved, by CPU topology */
+enum migrate_kind { MIGRATE_CORE, MIGRATE_LLC, MIGRATE_CROSS_LLC, MIGRATE_NUMA, MIGRATE_KINDS };
+static const char * const migrate_names[] = { "core", "llc", "cross-llc", "numa" };
+
+/*
+ * Latency histogram. Bucket i counts latencies in [2^(i-1), 2^i) ns,
+ * bucket 0 counts 0.
+ */
+struct lat_hist {
+    u32 count[LAT_BUCKETS];
+    u64 total;                      /* Sum of count */
+    u64 max;                        /* Largest latency seen, in ns */
+};
+
+/*
+ * When a task was woken, written on the waker's CPU and consumed when
+ * the task gets switched in, wherever that is. Slots are picked by
+ * hashing the pid. Two tasks sharing a slot only cost us one of their
+ * wakeups, the pid check stops the other task from consuming it.
+ */
+struct task_stamp {
+    pid_t pid;                      /* Task the stamp belongs to, 0 if unused */
+    pid_t waker;                    /* Task that woke it, 0 if an interrupt did */
+    u64 wake_ns;                    /* ktime_get_mono_fast_ns() at wakeup */
+};
+static struct task_stamp * task_stamps;
+
+/*
+ * CPU a task last ran on before being migrated, written wherever the
+ * migration happens and consumed when the task is next switched in.
+ * Shared like task_stamps. A task moved again before it runs keeps the
+ * CPU it first left, that's the cache it lost.
+ */
+struct migrate_stamp {
+    pid_t pid;                      /* Task the stamp belongs to, 0 if unused */
+    int from_cpu;
+};
+static struct migrate_stamp * migrate_stamps;
 
 /* Data for storing prev to be carried into ret_handler */
 struct my_data {
@@ -33,225 +199,3125 @@ struct my_data {
  * I'm going to additionally embed the pid in the entry so
  * when we iterate over it, we can further verify that this
  * entry indeed for that task_struct in case of collision.
+ *
+ * An entry is allocated from task_cache the first time a task runs
+ * on a CPU and after that only ever updated in place, so the switch
+ * path doesn't allocate or reorder anything.
+ *
+ * Entries are indexed by pid in the CPU's rhashtable, which the switch
+ * path and readers search without locks. The table is only changed
+ * from tasks_work in process context: its bucket locks disable bottom
+ * halves before 6.8, which must not happen in hard irq or under the rq
+ * lock, and inserting may wake the resize worker. So a new entry first
+ * goes on the CPU's pending chain, and an entry that is given back is
+ * marked dead and put on the retiring chain, where tasks_work picks
+ * them up. Entries are freed after an RCU grace period.
  */
 struct my_hash_table_struct {
-    unsigned long long tsc;         /* Stores the timestamp counter */
+    unsigned long long tsc;         /* Start of the running slice, 0 while not running here */
+    unsigned long long ttsc;        /* Total tsc the task ran on this CPU */
+    unsigned long long slices;      /* How many slices ttsc is made of */
+    u64 tsc_var;                    /* Variance of ttsc from sampling, in (tsc >> VAR_SHIFT)^2 */
+    u64 slices_var;                 /* Variance of slices from sampling */
+    struct lat_hist rq_lat;         /* Wakeup to switch in on this CPU */
+    struct list_head lru;           /* In the CPU's lru, least recently switched in first */
+    unsigned long window_sec;       /* Second the newest window slot is for */
+    u32 window[WINDOW_SLOTS];       /* Ring of tsc >> WINDOW_SHIFT run each second, by second % WINDOW_SLOTS */
+    unsigned long long migrations[MIGRATE_KINDS];   /* Switched in here after being migrated */
     pid_t pid;                      /* Keep the pid of the entry */
-    struct rb_node * node;          /* Reference to the rb_node for the task_struct */
-    struct hlist_node hash_list;    /* Kernel embedded linked list node for bucket */
+    bool hashed;                    /* In the CPU's tasks or being put there, only pending otherwise */
+    bool dead;                      /* Retired, lookups have to pass it over */
+    struct my_hash_table_struct * next_pending;     /* Next on the pending chain */
+    struct my_hash_table_struct * next_retiring;    /* Next on the retiring chain */
+    struct rhash_head node;         /* In the CPU's tasks */
+    struct rcu_head rcu;            /* For freeing after lockless lookups are done with it */
+};
+
+/* Only tasks_work changes the table, so it may resize either way */
+static const struct rhashtable_params task_params = {
+    .key_len = sizeof(pid_t),
+    .key_offset = offsetof(struct my_hash_table_struct, pid),
+    .head_offset = offsetof(struct my_hash_table_struct, node),
+    .automatic_shrinking = true,
+};
+
+/* What is left of the task entries that were given back, so totals still add up */
+struct retired_tasks {
+    unsigned long long tasks;       /* Entries folded in */
+    unsigned long long ttsc;
+    unsigned long long slices;
+};
+
+/* The slice being timed on a CPU, read to add its time so far */
+struct running_slice {
+    pid_t pid;                      /* Task running it, -1 if none is being timed */
+    u32 weight;                     /* sample_every when it was sampled */
+    u64 start;                      /* tsc it started at, 0 for kernel threads */
+};
+
+/*
+ * Time charged to a whole thread group or cgroup on one CPU. Added to
+ * on every switch along with the task's own entry, so reads never
+ * have to go through the tasks to build them. Also used for the
+ * totals over all CPUs during a read.
+ */
+struct group_entry {
+    u64 id;                         /* tgid or cgroup id */
+    unsigned long long ttsc;        /* Total tsc of every task in the group */
+    unsigned long long slices;      /* How many slices ttsc is made of */
+    char comm[TASK_COMM_LEN];       /* Name of the group leader, empty for cgroups */
+    struct hlist_node hash_list;    /* RCU list in the per-CPU tables */
+    struct list_head lru;           /* In its CPU's group_lru */
+    struct rcu_head rcu;
+};
+
+/*
+ * Everything one CPU accounts. A task's slice starts and ends on the
+ * CPU it runs on, so each CPU can keep its own hash table and the
+ * handlers never touch another CPU's data. The tables are only merged
+ * when /proc/perftop is read.
+ *
+ * The lock is only ever taken by this CPU's handler, tasks_work and
+ * exits, so on the scheduler path it is mostly uncontended. It is raw
+ * because the handler runs under the rq lock. Readers never take it,
+ * they find entries under RCU and copy them with snapshot(), which
+ * retries if seq says a switch changed them meanwhile.
+ */
+struct perftop_cpu {
+    raw_spinlock_t lock;            /* Protects changes to tasks, pending and lru */
+    seqcount_raw_spinlock_t seq;    /* Bumped around every change readers can see */
+    int pre_count;                  /* Counting entry */
+    int post_count;                 /* Counting return */
+    int context_switch_counter;     /* Counting number of context switches */
+    unsigned long long switch_events;   /* sched_switch tracepoint hits */
+    unsigned long long handler_cycles;  /* tsc spent inside our handlers */
+    struct lat_hist handler_hist;   /* tsc of each handler run, by this CPU only and outside seq */
+    unsigned long long alloc_failures;  /* Tasks left unaccounted because the spares ran out */
+    u32 countdown;                  /* Switches until the next sampled one */
+    struct running_slice running;   /* Slice in progress here */
+    struct rnd_state rnd;           /* Spaces the sampled switches out */
+    struct lat_hist rq_lat;         /* Wakeup to switch in, for every task switched in here */
+    unsigned long long migrations[MIGRATE_KINDS];   /* Tasks migrated to this CPU */
+    struct wake_edge * edges;       /* WAKE_EDGES entries, allocated when the wakeup graph starts */
+    int nr_edges;                   /* Entries of edges in use */
+    u64 edges_dropped;              /* New edges that didn't fit in edges */
+    DECLARE_HASHTABLE(edge_table, 8);   /* edges by waker and wakee */
+    struct rhashtable tasks;        /* Tasks that ran on this CPU, by pid */
+    struct my_hash_table_struct * pending;  /* New entries waiting for tasks_work */
+    struct my_hash_table_struct * retiring; /* Dead entries tasks_work has to take out of tasks */
+    struct irq_work kick_work;      /* Queues tasks_work once we're out of the switch path */
+    struct work_struct tasks_work;  /* Applies pending and retiring to tasks */
+    struct list_head lru;           /* Every entry, least recently switched in first */
+    void * spare_tasks[SPARE_ENTRIES];  /* From task_cache, refilled by tasks_work */
+    int nr_spare_tasks;
+    void * spare_groups[SPARE_ENTRIES]; /* From group_cache, refilled by tasks_work */
+    int nr_spare_groups;
+    struct retired_tasks exited;    /* Tasks that exited */
+    struct retired_tasks evicted;   /* Tasks pushed out by max_tasks */
+    DECLARE_HASHTABLE(tgids, 8);    /* group_entry per process that ran on this CPU */
+    DECLARE_HASHTABLE(cgroups, 6);  /* group_entry per cgroup that ran on this CPU */
+    struct list_head group_lru;     /* Both tables' entries, least recently charged first */
+    unsigned long long groups_evicted;  /* Group entries pushed out by max_groups */
+};
+
+/*
+ * One distinct stack seen by the sampler, keyed by the process and its
+ * frames. count is how many samples hit it.
+ */
+struct stack_sample {
+    u32 hash;                       /* jhash of tgid and the frames */
+    pid_t tgid;                     /* Process the stack belongs to */
+    char comm[TASK_COMM_LEN];       /* Name of the first thread sampled with it */
+    u16 nr_kernel;                  /* Kernel frames at the start of ips */
+    u16 nr_user;                    /* User frames after them */
+    u64 count;                      /* Samples that hit this stack */
+    unsigned long ips[2 * STACK_DEPTH];     /* Kernel then user frames, innermost first */
+    struct hlist_node hash_list;
+};
+
+/*
+ * The sampler's per-CPU state. Only the timer on this CPU adds to it,
+ * and never concurrently with itself, so it takes no locks. pool is
+ * filled from the front and used is published after an entry is
+ * complete, which lets readers walk [0, used) without stopping it.
+ */
+struct sampler_cpu {
+    struct hrtimer timer;           /* Pinned to this CPU, fires sample_hz times a second */
+    struct stack_sample * pool;     /* STACK_POOL_SIZE entries, allocated on first start */
+    int used;                       /* Entries of pool in use */
+    struct stack_sample scratch;    /* Stack being sampled, before we know if it's new */
+    u64 samples;                    /* Timer hits */
+    u64 idle;                       /* Hits in the idle task, not recorded */
+    u64 dropped;                    /* New stacks that didn't fit in pool */
+    u64 cycles;                     /* tsc spent sampling */
+    DECLARE_HASHTABLE(stacks, 10);  /* pool entries by hash */
+};
+
+/*
+ * One distinct kernel stack a task blocked in. Only the CPU the task
+ * went to sleep on adds entries to its pool, but the blocked time is
+ * charged by whichever CPU the task is switched back in on.
+ */
+struct offcpu_stack {
+    u32 hash;                       /* jhash of pid and the frames */
+    pid_t pid;                      /* Task that blocked here */
+    char comm[TASK_COMM_LEN];
+    u16 nr;                         /* Frames in ips */
+    atomic64_t blocked_ns;          /* Time spent off CPU after blocking here */
+    atomic64_t blocks;              /* Times the task blocked here */
+    unsigned long ips[STACK_DEPTH]; /* Innermost first */
+    struct hlist_node hash_list;
+};
+
+/* An offcpu_stack added up over every CPU, for reads */
+struct offcpu_total {
+    pid_t pid;
+    char comm[TASK_COMM_LEN];
+    u16 nr;
+    u64 blocked_ns;
+    u64 blocks;
+    const unsigned long * ips;      /* Of one of the entries, valid while offcpu_mutex is held */
+};
+
+/* Off-CPU profiling's per-CPU state, written only by this CPU's switch handler */
+struct offcpu_cpu {
+    struct offcpu_stack * pool;     /* OFFCPU_POOL_SIZE entries, allocated on first start */
+    int used;                       /* Entries of pool in use, published like sampler_cpu's */
+    struct offcpu_stack scratch;    /* Stack being recorded, before we know if it's new */
+    u64 dropped;                    /* New stacks that didn't fit in pool */
+    DECLARE_HASHTABLE(stacks, 10);  /* pool entries by hash */
+};
+
+/*
+ * When a task blocked and where, left by the CPU it blocked on for the
+ * one it is switched back in on. Slots are shared the way task_stamps
+ * are, and stack->pid is checked too, since two tasks writing one slot
+ * at the same time could leave it mixed.
+ */
+struct offcpu_stamp {
+    pid_t pid;                      /* Task the stamp belongs to, 0 if unused */
+    u64 sleep_ns;                   /* ktime_get_mono_fast_ns() at switch out */
+    struct offcpu_stack * stack;
+};
+
+/*
+ * Wakeups of wakee by waker, counted on the CPU wakee was switched in
+ * on, with how long wakee then waited to run. Lives in its CPU's edges
+ * pool, which only that CPU's switch handler adds to.
+ */
+struct wake_edge {
+    pid_t waker;                    /* 0 for wakeups from interrupts */
+    pid_t wakee;
+    u64 wakeups;                    /* Scaled like slices when sampling */
+    u64 wait_ns;                    /* Wakeup to switch in, summed over wakeups */
+    struct lat_hist lat;            /* Wakeup to switch in, sampled wakeups only */
+    struct hlist_node hash_list;
+};
+
+/*
+ * Slow path of one kind of lock. Only one of a kind's symbols needs to
+ * exist, the first one that can be probed is used.
+ */
+struct lock_func {
+    const char * kind;
+    const char * symbols[2];
+};
+
+static const struct lock_func lock_funcs[] = {
+    { "spin", { "native_queued_spin_lock_slowpath", "queued_spin_lock_slowpath" } },
+    { "mutex", { "__mutex_lock_slowpath", NULL } },
+    { "rwsem-read", { "rwsem_down_read_slowpath", NULL } },
+    { "rwsem-write", { "rwsem_down_write_slowpath", NULL } },
+};
+#define LOCK_KINDS ARRAY_SIZE(lock_funcs)
+
+struct lock_probe {
+    struct kretprobe rp;
+    int kind;                       /* Index in lock_funcs */
+    bool registered;
+};
+
+/* Where a contended lock was taken, carried from entry to return of the slow path */
+struct lock_call {
+    u64 start_ns;
+    u16 nr;
+    unsigned long ips[LOCK_SITE_DEPTH];
+};
+
+/*
+ * One call site that hit a lock's slow path, keyed by the kind of lock
+ * and the frames above the slow path. Kept in the pool of the CPU the
+ * slow path returned on.
+ */
+struct lock_site {
+    u32 hash;                       /* jhash of kind and the frames */
+    u16 kind;
+    u16 nr;
+    unsigned long ips[LOCK_SITE_DEPTH];     /* Innermost first */
+    u64 contended;                  /* Times the slow path was taken here */
+    u64 wait_ns;                    /* Time spent in it */
+    struct lat_hist hist;
+    struct hlist_node hash_list;
+};
+
+/* The lock profiler's per-CPU state, only return handlers on this CPU add to it */
+struct lock_cpu {
+    struct lock_site * pool;        /* LOCK_SITES entries, allocated on first start */
+    int used;                       /* Entries of pool in use, published like sampler_cpu's */
+    u64 dropped;                    /* New sites that didn't fit in pool */
+    DECLARE_HASHTABLE(sites, 8);    /* pool entries by hash */
+};
+
+/* One profiled function's calls on one CPU */
+struct func_cpu {
+    struct lat_hist hist;           /* Entry to return, in ns */
+    u64 total_ns;                   /* Sum of every call's latency */
+};
+
+/* A kernel function profiled in function latency mode */
+struct func_probe {
+    struct kretprobe rp;            /* Both handlers are shared by every function */
+    char name[KSYM_NAME_LEN];
+    struct func_cpu __percpu * stats;
+};
+
+/* One task's totals summed over all CPUs, only lives during a read */
+struct merged_task {
+    unsigned long long ttsc;        /* Total tsc over all CPUs */
+    unsigned long long slices;      /* Slices over all CPUs */
+    u64 tsc_var;                    /* Sampling variance of ttsc and slices over all CPUs */
+    u64 slices_var;
+    struct lat_hist rq_lat;         /* Wakeup latency over all CPUs */
+    unsigned long long window_tsc;  /* tsc run in the last window_secs full seconds */
+    unsigned long long load;        /* Decayed tsc per second */
+    unsigned long long migrations[MIGRATE_KINDS];
+    unsigned long long key;         /* Value of sort_key, filled in before selecting */
+    pid_t pid;
+    struct hlist_node hash_list;
+};
+
+/* Used for finding a task's merged_task during a read */
+struct merge_table {
+    DECLARE_HASHTABLE(tasks, 10);
+};
+
+/* Used for adding up group_entry over all CPUs during a read */
+struct group_table {
+    DECLARE_HASHTABLE(groups, 8);
+};
+
+static void hist_add(struct lat_hist * hist, u64 ns) {
+    int bucket = fls64(ns);
+    
+    if (bucket >= LAT_BUCKETS)
+        bucket = LAT_BUCKETS - 1;
+    hist->count[bucket]++;
+    hist->total++;
+    if (ns > hist->max)
+        hist->max = ns;
+}
+
+static void hist_merge(struct lat_hist * dst, const struct lat_hist * src) {
+    int i;
+    
+    for (i = 0; i < LAT_BUCKETS; i++)
+        dst->count[i] += src->count[i];
+    dst->total += src->total;
+    if (src->max > dst->max)
+        dst->max = src->max;
+}
+
+/*
+ * Upper bound in ns of the bucket holding the pct-th percentile, which
+ * is within a factor of 2 of the real value. Capped at max.
+ */
+static u64 hist_percentile(const struct lat_hist * hist, int pct) {
+    u64 wanted = div64_u64(hist->total * pct + 99, 100);
+    u64 seen = 0;
+    int i;
+    
+    if (!hist->total)
+        return 0;
+    for (i = 0; i < LAT_BUCKETS - 1; i++) {
+        seen += hist->count[i];
+        if (seen >= wanted)
+            return min_t(u64, i ? 1ULL << i : 0, hist->max);
+    }
+    return hist->max;
+}
+
+/* Seconds for the rolling windows, jiffies based so it's cheap on the switch path */
+static inline unsigned long window_now(void) {
+    return jiffies / HZ;
+}
+
+/*
+ * Add elapsed tsc to the slot for sec. Slots for seconds the task didn't
+ * run in since its newest slot still hold data from WINDOW_SLOTS seconds
+ * ago, so they are cleared first. A slice is charged entirely to the
+ * second it ends in.
+ */
+static void window_add(struct my_hash_table_struct * entry, unsigned long sec, u64 elapsed) {
+    unsigned long gap = sec - entry->window_sec;
+    u32 * slot = &entry->window[sec % WINDOW_SLOTS];
+    unsigned long i;
+    
+    if (gap) {
+        if (gap >= WINDOW_SLOTS)
+            memset(entry->window, 0, sizeof(entry->window));
+        else
+            for (i = 1; i <= gap; i++)
+                entry->window[(entry->window_sec + i) % WINDOW_SLOTS] = 0;
+        entry->window_sec = sec;
+    }
+    /* Sampled slices are scaled up and could overflow a slot */
+    *slot = min_t(u64, (u64)*slot + (elapsed >> WINDOW_SHIFT), U32_MAX);
+}
+
+/*
+ * tsc >> WINDOW_SHIFT entry ran in the second age seconds before now,
+ * 0 if that slot is stale or was never written.
+ */
+static u64 window_slot(const struct my_hash_table_struct * entry, unsigned long now, int age) {
+    unsigned long sec = now - age;
+    
+    if ((long)(sec - entry->window_sec) > 0 || entry->window_sec - sec >= WINDOW_SLOTS)
+        return 0;
+    return entry->window[sec % WINDOW_SLOTS];
+}
+
+/* tsc entry ran in the last secs full seconds, the current one isn't over yet */
+static u64 window_sum(const struct my_hash_table_struct * entry, unsigned long now, int secs) {
+    u64 sum = 0;
+    int age;
+    
+    for (age = 1; age <= secs; age++)
+        sum += window_slot(entry, now, age);
+    return sum << WINDOW_SHIFT;
+}
+
+/*
+ * Exponentially decayed tsc per second over the full seconds in the
+ * ring, each second weighted by e^(-age/10), so a task that stops
+ * running fades out over tens of seconds.
+ */
+static u64 window_load(const struct my_hash_table_struct * entry, unsigned long now) {
+    u64 sum = 0;
+    int age;
+    
+    for (age = 1; age < WINDOW_SLOTS; age++)
+        sum += window_slot(entry, now, age) * load_decay[age];
+    return div64_u64(sum, load_decay_total) << WINDOW_SHIFT;
+}
+
+/* Fill in load_decay, there is no floating point to call exp() with */
+static void load_decay_init(void) {
+    int age;
+    
+    load_decay[0] = 1 << 16;
+    load_decay_total = 0;
+    for (age = 1; age < WINDOW_SLOTS; age++) {
+        load_decay[age] = ((u64)load_decay[age - 1] * LOAD_DECAY) >> 16;
+        load_decay_total += load_decay[age];
+    }
+}
+
+/* tsc as a share of secs seconds of one CPU, in hundredths of a percent */
+static u64 cpu_share(u64 tsc, int secs) {
+    return div64_u64(tsc * 10000, (u64)tsc_khz * 1000 * secs ? : 1);
+}
+
+/* State prev is being switched out in, 0 (runnable) if it was preempted */
+static unsigned int switch_out_state(bool preempt, struct task_struct * prev) {
+    if (preempt)
+        return 0;
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(5, 14, 0)
+    return READ_ONCE(prev->__state);
+#else
+    return READ_ONCE(prev->state);
+#endif
+}
+
+/*
+ * Put a switch into this CPU's ring, see perftop_ring.h. We are the
+ * only producer for this ring and switches don't nest, so all it takes
+ * is checking for room against tail and publishing with head.
+ */
+static void ring_emit(struct task_struct * prev, struct task_struct * next, unsigned int state) {
+    void * area = READ_ONCE(ring_area);
+    struct perftop_ring_ctl * ctl;
+    struct perftop_event * event;
+    int cpu = smp_processor_id();
+    u64 head;
+    
+    if (!area || !atomic_read(&ring_users))
+        return;
+    
+    ctl = area + PERFTOP_RING_PAGE + cpu * ring_stride;
+    head = ctl->head;
+    
+    /* Acquire, the consumer has to be done with a slot before we reuse it */
+    if (head - smp_load_acquire(&ctl->tail) >= ring_events) {
+        ctl->lost++;
+        return;
+    }
+    
+    event = (void *)ctl + PERFTOP_RING_PAGE + (head & (ring_events - 1)) * sizeof(struct perftop_event);
+    event->ts = ktime_get_mono_fast_ns();
+    event->cpu = cpu;
+    event->prev_state = state;
+    event->prev_pid = prev->pid;
+    event->prev_tgid = prev->tgid;
+    event->next_pid = next->pid;
+    event->next_tgid = next->tgid;
+    smp_store_release(&ctl->head, head + 1);
+}
+
+/*
+ * Find or add prev's current kernel stack in this CPU's pool. We run in
+ * __schedule on prev's stack, so it is saved as is, minus our own
+ * frames on top. NULL if the pool is full.
+ */
+static struct offcpu_stack * record_offcpu_stack(struct offcpu_cpu * oc, struct task_struct * prev) {
+    struct offcpu_stack * sample = &oc->scratch;
+    struct offcpu_stack * position;
+    unsigned int nr, i;
+    
+    nr = stack_trace_save(sample->ips, STACK_DEPTH, 0);
+    for (i = 0; i < nr && within_module(sample->ips[i], THIS_MODULE); i++)
+        ;
+    memmove(sample->ips, sample->ips + i, (nr - i) * sizeof(unsigned long));
+    sample->nr = nr - i;
+    sample->hash = jhash(sample->ips, sample->nr * sizeof(unsigned long), prev->pid);
+    
+    hash_for_each_possible(oc->stacks, position, hash_list, sample->hash) {
+        if (position->hash == sample->hash && position->pid == prev->pid &&
+                position->nr == sample->nr &&
+                !memcmp(position->ips, sample->ips, sample->nr * sizeof(unsigned long)))
+            return position;
+    }
+    
+    if (oc->used == OFFCPU_POOL_SIZE) {
+        oc->dropped++;
+        return NULL;
+    }
+    
+    /* New stack, fill in the entry before publishing it through used */
+    position = &oc->pool[oc->used];
+    position->hash = sample->hash;
+    position->pid = prev->pid;
+    position->nr = sample->nr;
+    atomic64_set(&position->blocked_ns, 0);
+    atomic64_set(&position->blocks, 0);
+    memcpy(position->comm, prev->comm, TASK_COMM_LEN);
+    memcpy(position->ips, sample->ips, sample->nr * sizeof(unsigned long));
+    hash_add(oc->stacks, &position->hash_list, position->hash);
+    smp_store_release(&oc->used, oc->used + 1);
+    return position;
+}
+NOKPROBE_SYMBOL(record_offcpu_stack);   /* Don't probe this function */
+
+/*
+ * Off-CPU side of a switch. next's time since it blocked is charged to
+ * the stack it blocked in, and if prev is going to sleep (state isn't
+ * 0) its stack is recorded and stamped. Preempted tasks are still
+ * runnable, so only blocking counts.
+ */
+static void offcpu_switch(struct task_struct * prev, struct task_struct * next, unsigned int state) {
+    struct offcpu_stamp * stamp;
+    struct offcpu_stack * stack;
+    u64 now;
+    
+    if (!smp_load_acquire(&offcpu))
+        return;
+    now = ktime_get_mono_fast_ns();
+    
+    /* Unused slots have pid 0, don't let the idle task take them */
+    stamp = &offcpu_stamps[hash_32(next->pid, STAMP_BITS)];
+    if (next->pid && READ_ONCE(stamp->pid) == next->pid) {
+        smp_rmb();  /* Pairs with the smp_wmb below */
+        stack = READ_ONCE(stamp->stack);
+        if (stack->pid == next->pid) {
+            atomic64_add(now - READ_ONCE(stamp->sleep_ns), &stack->blocked_ns);
+            atomic64_inc(&stack->blocks);
+        }
+        WRITE_ONCE(stamp->pid, 0);
+    }
+    
+    if (!state || !prev->mm || (prev->flags & PF_EXITING))
+        return;
+    stack = record_offcpu_stack(this_cpu_ptr(offcpu_cpus), prev);
+    if (!stack)
+        return;
+    stamp = &offcpu_stamps[hash_32(prev->pid, STAMP_BITS)];
+    WRITE_ONCE(stamp->sleep_ns, now);
+    WRITE_ONCE(stamp->stack, stack);
+    smp_wmb();      /* sleep_ns and stack have to be there before the pid claims the slot */
+    WRITE_ONCE(stamp->pid, prev->pid);
+}
+NOKPROBE_SYMBOL(offcpu_switch);     /* Don't probe this function */
+NOKPROBE_SYMBOL(ring_emit);     /* Don't probe this function */
+
+/* Allocate the rings the first time anyone opens /dev/perftop */
+static int ring_open(struct inode * inode, struct file * file) {
+    struct perftop_ring_info * info;
+    void * area;
+    int ret = 0;
+    
+    mutex_lock(&ring_mutex);
+    if (!ring_area) {
+        if (ring_kb < 4 || ring_kb > 65536) {
+            ret = -EINVAL;
+            goto out;
+        }
+        ring_events = rounddown_pow_of_two(ring_kb * 1024 / sizeof(struct perftop_event));
+        ring_stride = PERFTOP_RING_PAGE + PAGE_ALIGN(ring_events * sizeof(struct perftop_event));
+        
+        area = vmalloc_user(PERFTOP_RING_PAGE + nr_cpu_ids * ring_stride);
+        if (!area) {
+            ret = -ENOMEM;
+            goto out;
+        }
+        
+        info = area;
+        info->magic = PERFTOP_RING_MAGIC;
+        info->version = PERFTOP_RING_VERSION;
+        info->nr_cpus = nr_cpu_ids;
+        info->events_per_cpu = ring_events;
+        info->event_size = sizeof(struct perftop_event);
+        info->cpu_stride = ring_stride;
+        
+        /* Everything above has to be visible before producers see the area */
+        smp_store_release(&ring_area, area);
+    }
+    atomic_inc(&ring_users);
+out:
+    mutex_unlock(&ring_mutex);
+    return ret;
+}
+
+static int ring_release(struct inode * inode, struct file * file) {
+    atomic_dec(&ring_users);
+    return 0;
+}
+
+/*
+ * Maps from the start of the area, consumers map just the info page
+ * first to learn the size. They need write access for tail.
+ */
+static int ring_mmap(struct file * file, struct vm_area_struct * vma) {
+    unsigned long size = vma->vm_end - vma->vm_start;
+    
+    if (vma->vm_pgoff || size > PERFTOP_RING_PAGE + nr_cpu_ids * ring_stride ||
+            !(vma->vm_flags & VM_SHARED))
+        return -EINVAL;
+    return remap_vmalloc_range(vma, ring_area, 0);
+}
+
+static const struct file_operations ring_fops = {
+    .owner = THIS_MODULE,
+    .open = ring_open,
+    .release = ring_release,
+    .mmap = ring_mmap,
 };
 
-/* Dynamically allocate a hash table */
-struct hash_table_wrapper {
-    DECLARE_HASHTABLE(myhashtable, 10);
+static struct miscdevice ring_device = {
+    .minor = MISC_DYNAMIC_MINOR,
+    .name = "perftop",
+    .fops = &ring_fops,
+    .mode = 0600,     /* Every switch on the box, root only */
 };
 
-/* mystruct for red-black tree.
- * The rb-tree in this homework will be used to keep track
- * of the Total accumulated time that the task_struct spend in CPU.
- * The TAT is calculated by using the elapsed time (time in hash table - rdtsc())
- * and added to the initial time, which starts at 0.
+/*
+ * Callback for when func_name is called
+ */
+static int entry_pick_next_fair(struct kretprobe_instance * ri, struct pt_regs * regs) {
+    struct my_data * data;
+    unsigned long long start_tsc = rdtsc();
+    
+    if (!current->mm)
+        return 1;   /* Skip kernel threads*/
+    /*
+     * %rdi contain struct rq * rq
+     * %rsi contain struct task_struct * prev
+     * %rdx contain struct rq_flags * rf
+     * https://wiki.osdev.org/System_V_ABI
+     * https://aaronbloomfield.github.io/pdr/book/x86-64bit-ccc-chapter.pdf
+     */
+    data = (struct my_data *)ri->data;  /* Get the data from instance, typecast to my_data */
+    data->prev = regs->si;              /* %rsi is the second parameter that contain prev */
+    this_cpu_inc(perftop_cpus->pre_count);
+    this_cpu_add(perftop_cpus->handler_cycles, rdtsc() - start_tsc);
+    return 0;
+}
+NOKPROBE_SYMBOL(entry_pick_next_fair);    /* Don't probe this function */
+
+static void free_task_entry(struct rcu_head * rcu) {
+    kmem_cache_free(task_cache, container_of(rcu, struct my_hash_table_struct, rcu));
+}
+
+static void free_group_entry(struct rcu_head * rcu) {
+    kmem_cache_free(group_cache, container_of(rcu, struct group_entry, rcu));
+}
+
+/*
+ * Copy size bytes of cpu_data's accounting at src without stopping its
+ * switch path, copying again if a switch changed them while we did.
+ */
+static void snapshot(struct perftop_cpu * cpu_data, void * dst, const void * src, size_t size) {
+    unsigned int seq;
+    
+    do {
+        seq = read_seqcount_begin(&cpu_data->seq);
+        memcpy(dst, src, size);
+    } while (read_seqcount_retry(&cpu_data->seq, seq));
+}
+
+/* pid's entry on this CPU, NULL if it has none. Lockless for entries in tasks */
+static struct my_hash_table_struct * find_task_entry(struct perftop_cpu * cpu_data, pid_t pid) {
+    struct my_hash_table_struct * position;
+    
+    /* A dead entry may still be hashed, a new one for pid is then pending */
+    position = rhashtable_lookup_fast(&cpu_data->tasks, &pid, task_params);
+    if (position && !READ_ONCE(position->dead))
+        return position;
+    
+    /* Only a few switches' worth of new tasks can be waiting here */
+    for (position = cpu_data->pending; position; position = position->next_pending) {
+        if (position->pid == pid && !position->dead)
+            return position;
+    }
+    return NULL;
+}
+NOKPROBE_SYMBOL(find_task_entry);   /* Don't probe this function */
+
+/* Take entry off the pending chain, called with the lock held */
+static void unlink_pending(struct perftop_cpu * cpu_data, struct my_hash_table_struct * entry) {
+    struct my_hash_table_struct ** link;
+    
+    for (link = &cpu_data->pending; *link; link = &(*link)->next_pending) {
+        if (*link == entry) {
+            *link = entry->next_pending;
+            break;
+        }
+    }
+}
+NOKPROBE_SYMBOL(unlink_pending);    /* Don't probe this function */
+
+/*
+ * Fold entry into retired and take it out of its CPU's lru. A pending
+ * entry was never hashed and is freed once lockless lookups can't see
+ * it anymore, a hashed one is marked dead and left for tasks_work to
+ * take out of tasks, and off pending if it was still being inserted.
+ * Called with the lock held, the caller queues tasks_work.
+ */
+static void retire_entry(struct perftop_cpu * cpu_data, struct retired_tasks * retired,
+        struct my_hash_table_struct * entry) {
+    retired->tasks++;
+    retired->ttsc += entry->ttsc;
+    retired->slices += entry->slices;
+    list_del(&entry->lru);
+    atomic_dec(&tracked_tasks);
+    
+    if (entry->hashed) {
+        WRITE_ONCE(entry->dead, true);
+        entry->next_retiring = cpu_data->retiring;
+        cpu_data->retiring = entry;
+        return;
+    }
+    unlink_pending(cpu_data, entry);
+    call_rcu(&entry->rcu, free_task_entry);
+}
+NOKPROBE_SYMBOL(retire_entry);      /* Don't probe this function */
+
+/*
+ * Take this CPU's retiring entries out of tasks and insert its pending
+ * ones, in that order so a dead entry never blocks the new entry of a
+ * reused pid for long. Runs in process context with the lock dropped
+ * around the table changes.
+ *
+ * An entry stays on pending until its insert is done, so switches and
+ * exits in between still find it. Marking it hashed keeps retire_entry
+ * from unlinking or freeing it under us: one that dies meanwhile goes on
+ * the retiring chain instead and is taken out on the next run. Entries
+ * made after we start are ahead of ours on the chain and wait for the
+ * next run too.
+ */
+static void refill_spares(struct perftop_cpu * cpu_data);
+
+static void update_tasks(struct work_struct * work) {
+    struct perftop_cpu * cpu_data = container_of(work, struct perftop_cpu, tasks_work);
+    struct my_hash_table_struct * position, * next, * retiring;
+    bool inserted;
+    
+    raw_spin_lock_irq(&cpu_data->lock);
+    retiring = cpu_data->retiring;
+    cpu_data->retiring = NULL;
+    position = cpu_data->pending;
+    for (next = position; next; next = next->next_pending)
+        next->hashed = true;    /* Before it can be found, see retire_entry */
+    raw_spin_unlock_irq(&cpu_data->lock);
+    
+    for (; retiring; retiring = next) {
+        next = retiring->next_retiring;
+        rhashtable_remove_fast(&cpu_data->tasks, &retiring->node, task_params);
+        call_rcu(&retiring->rcu, free_task_entry);
+    }
+    
+    for (; position; position = next) {
+        inserted = !rhashtable_insert_fast(&cpu_data->tasks, &position->node, task_params);
+        
+        /*
+         * A failed insert means no memory for the table, or a dead entry
+         * for the pid is still in it. A live entry then stays pending for
+         * the next run, a dead one is on the retiring chain already.
+         */
+        raw_spin_lock_irq(&cpu_data->lock);
+        next = position->next_pending;
+        if (inserted || position->dead)
+            unlink_pending(cpu_data, position);
+        else
+            position->hashed = false;
+        raw_spin_unlock_irq(&cpu_data->lock);
+    }
+    
+    refill_spares(cpu_data);
+}
+
+/*
+ * Top one pool of spare entries back up to SPARE_ENTRIES. The switch
+ * path runs under the rq lock, where even GFP_ATOMIC may wake kswapd, so
+ * it only ever takes from the pools. Allocates with the lock dropped,
+ * process context only.
+ */
+static void refill_pool(struct perftop_cpu * cpu_data, struct kmem_cache * cache, void ** pool,
+        int * count) {
+    void * fresh[SPARE_ENTRIES];
+    int wanted = SPARE_ENTRIES - READ_ONCE(*count);
+    int got, i;
+    
+    for (got = 0; got < wanted; got++) {
+        if (!(fresh[got] = kmem_cache_alloc(cache, GFP_KERNEL | __GFP_NOWARN)))
+            break;
+    }
+    
+    raw_spin_lock_irq(&cpu_data->lock);
+    for (i = 0; i < got && *count < SPARE_ENTRIES; i++)
+        pool[(*count)++] = fresh[i];
+    raw_spin_unlock_irq(&cpu_data->lock);
+    
+    /* Only the switch path takes from the pool, so normally nothing is left */
+    for (; i < got; i++)
+        kmem_cache_free(cache, fresh[i]);
+}
+
+static void refill_spares(struct perftop_cpu * cpu_data) {
+    refill_pool(cpu_data, task_cache, cpu_data->spare_tasks, &cpu_data->nr_spare_tasks);
+    refill_pool(cpu_data, group_cache, cpu_data->spare_groups, &cpu_data->nr_spare_groups);
+}
+
+/* Give the spares back, once nothing can take them anymore */
+static void free_spares(struct perftop_cpu * cpu_data) {
+    while (cpu_data->nr_spare_tasks)
+        kmem_cache_free(task_cache, cpu_data->spare_tasks[--cpu_data->nr_spare_tasks]);
+    while (cpu_data->nr_spare_groups)
+        kmem_cache_free(group_cache, cpu_data->spare_groups[--cpu_data->nr_spare_groups]);
+}
+
+/* Hard irq right after the switch that queued us, where queueing work is allowed */
+static void kick_tasks_work(struct irq_work * work) {
+    schedule_work(&container_of(work, struct perftop_cpu, kick_work)->tasks_work);
+}
+
+/*
+ * Find pid's entry on this CPU, making one if it's the first time pid
+ * runs here. Once max_tasks are tracked over all CPUs, the entry of the
+ * task switched in least recently on this CPU is evicted first. Other
+ * CPUs' entries are left alone, so a CPU with none of its own can go
+ * over by one. New entries come from the spares, NULL if they ran out,
+ * the task then goes unaccounted on this switch.
+ */
+static struct my_hash_table_struct * get_task_entry(struct perftop_cpu * cpu_data, pid_t pid) {
+    struct my_hash_table_struct * position;
+    
+    position = find_task_entry(cpu_data, pid);
+    if (position)
+        return position;
+    
+    if (atomic_read(&tracked_tasks) >= max_tasks && !list_empty(&cpu_data->lru)) {
+        position = list_first_entry(&cpu_data->lru, struct my_hash_table_struct, lru);
+        retire_entry(cpu_data, &cpu_data->evicted, position);
+        irq_work_queue(&cpu_data->kick_work);
+    }
+    
+    if (!cpu_data->nr_spare_tasks) {
+        cpu_data->alloc_failures++;
+        irq_work_queue(&cpu_data->kick_work);
+        return NULL;
+    }
+    position = cpu_data->spare_tasks[--cpu_data->nr_spare_tasks];
+    position->pid = pid;
+    position->tsc = 0;
+    position->ttsc = 0;
+    position->slices = 0;
+    position->tsc_var = 0;
+    position->slices_var = 0;
+    memset(&position->rq_lat, 0, sizeof(struct lat_hist));
+    position->window_sec = 0;
+    memset(position->window, 0, sizeof(position->window));
+    memset(position->migrations, 0, sizeof(position->migrations));
+    position->hashed = false;
+    position->dead = false;
+    position->next_pending = cpu_data->pending;
+    cpu_data->pending = position;
+    list_add_tail(&position->lru, &cpu_data->lru);
+    atomic_inc(&tracked_tasks);
+    irq_work_queue(&cpu_data->kick_work);
+    return position;
+}
+NOKPROBE_SYMBOL(get_task_entry);    /* Don't probe this function */
+
+/* Take group out of its CPU's tables, called with the lock held */
+static void drop_group_entry(struct group_entry * group) {
+    hlist_del_rcu(&group->hash_list);
+    list_del(&group->lru);
+    atomic_dec(&tracked_groups);
+    call_rcu(&group->rcu, free_group_entry);
+}
+NOKPROBE_SYMBOL(drop_group_entry);  /* Don't probe this function */
+
+/*
+ * Find id's entry in one of this CPU's group tables, which has 1 << bits
+ * buckets, making one if needed. Past max_groups over all CPUs the
+ * entry of this CPU charged least recently goes first, like tasks do
+ * with max_tasks. New entries come from the spares, NULL if they ran out.
+ */
+static struct group_entry * get_group_entry(struct perftop_cpu * cpu_data, struct hlist_head * table,
+        unsigned int bits, u64 id) {
+    struct hlist_head * head = &table[hash_min(id, bits)];
+    struct group_entry * group;
+    
+    hlist_for_each_entry(group, head, hash_list) {
+        if (group->id == id) {
+            list_move_tail(&group->lru, &cpu_data->group_lru);
+            return group;
+        }
+    }
+    
+    if (atomic_read(&tracked_groups) >= max_groups && !list_empty(&cpu_data->group_lru)) {
+        drop_group_entry(list_first_entry(&cpu_data->group_lru, struct group_entry, lru));
+        cpu_data->groups_evicted++;
+    }
+    
+    /* tasks_work tops the spares back up */
+    irq_work_queue(&cpu_data->kick_work);
+    if (!cpu_data->nr_spare_groups) {
+        cpu_data->alloc_failures++;
+        return NULL;
+    }
+    group = cpu_data->spare_groups[--cpu_data->nr_spare_groups];
+    group->id = id;
+    group->ttsc = 0;
+    group->slices = 0;
+    group->comm[0] = '\0';
+    hlist_add_head_rcu(&group->hash_list, head);
+    list_add_tail(&group->lru, &cpu_data->group_lru);
+    atomic_inc(&tracked_groups);
+    return group;
+}
+NOKPROBE_SYMBOL(get_group_entry);   /* Don't probe this function */
+
+/* Default hierarchy cgroup of p, 0 without cgroup support */
+static u64 task_cgroup_id(struct task_struct * p) {
+#if defined(CONFIG_CGROUPS) && LINUX_VERSION_CODE >= KERNEL_VERSION(5, 5, 0)
+    u64 id;
+    
+    rcu_read_lock();
+    id = cgroup_id(task_dfl_cgroup(p));
+    rcu_read_unlock();
+    return id;
+#else
+    return 0;
+#endif
+}
+NOKPROBE_SYMBOL(task_cgroup_id);    /* Don't probe this function */
+
+/*
+ * Charge elapsed tsc of slices of prev's slices to its process and cgroup.
+ * An exiting task isn't charged: the last thread out may have freed its
+ * process's entries already, and a sibling still on its way out would
+ * only make a new one nothing frees.
+ */
+static void account_groups(struct perftop_cpu * cpu_data, struct task_struct * prev, u64 elapsed,
+        u64 slices) {
+    struct group_entry * group;
+    
+    if (prev->flags & PF_EXITING)
+        return;
+    
+    group = get_group_entry(cpu_data, cpu_data->tgids, HASH_BITS(cpu_data->tgids), prev->tgid);
+    if (group) {
+        if (!group->comm[0])
+            memcpy(group->comm, prev->group_leader->comm, TASK_COMM_LEN);
+        group->ttsc += elapsed;
+        group->slices += slices;
+    }
+    
+    group = get_group_entry(cpu_data, cpu_data->cgroups, HASH_BITS(cpu_data->cgroups),
+            task_cgroup_id(prev));
+    if (group) {
+        group->ttsc += elapsed;
+        group->slices += slices;
+    }
+}
+NOKPROBE_SYMBOL(account_groups);    /* Don't probe this function */
+
+/*
+ * Take next's wakeup stamp if it has one. Returns how long ago it was
+ * woken in ns, or -1 if it wasn't (it was preempted, or the stamp was lost).
+ * The waker's pid goes in waker.
+ */
+static s64 take_wakeup_stamp(struct task_struct * next, pid_t * waker) {
+    struct task_stamp * stamp;
+    u64 wake_ns;
+    
+    if (!task_stamps)
+        return -1;
+    
+    stamp = &task_stamps[hash_32(next->pid, STAMP_BITS)];
+    if (READ_ONCE(stamp->pid) != next->pid)
+        return -1;
+    smp_rmb();      /* Pairs with smp_wmb in probe_sched_wakeup */
+    wake_ns = READ_ONCE(stamp->wake_ns);
+    *waker = READ_ONCE(stamp->waker);
+    WRITE_ONCE(stamp->pid, 0);
+    return ktime_get_mono_fast_ns() - wake_ns;
+}
+NOKPROBE_SYMBOL(take_wakeup_stamp);     /* Don't probe this function */
+
+/*
+ * Count one wakeup of wakee by waker on this CPU, weight times when
+ * sampling. Called with the CPU's lock held, inside its seqcount.
+ */
+static void add_wake_edge(struct perftop_cpu * cpu_data, pid_t waker, pid_t wakee, s64 latency,
+        u32 weight) {
+    u32 key = hash_32(waker, 32) ^ wakee;
+    struct wake_edge * edge;
+    
+    hash_for_each_possible(cpu_data->edge_table, edge, hash_list, key) {
+        if (edge->waker == waker && edge->wakee == wakee)
+            goto found;
+    }
+    
+    if (cpu_data->nr_edges == WAKE_EDGES) {
+        cpu_data->edges_dropped++;
+        return;
+    }
+    
+    /* New edge, fill in the entry before publishing it through nr_edges */
+    edge = &cpu_data->edges[cpu_data->nr_edges];
+    edge->waker = waker;
+    edge->wakee = wakee;
+    edge->wakeups = 0;
+    edge->wait_ns = 0;
+    memset(&edge->lat, 0, sizeof(struct lat_hist));
+    hash_add(cpu_data->edge_table, &edge->hash_list, key);
+    smp_store_release(&cpu_data->nr_edges, cpu_data->nr_edges + 1);
+    
+found:
+    edge->wakeups += weight;
+    edge->wait_ns += latency * weight;
+    hist_add(&edge->lat, latency);
+}
+NOKPROBE_SYMBOL(add_wake_edge);     /* Don't probe this function */
+
+/* Take next's migration stamp if it has one. Returns the CPU it came from, or -1 */
+static int take_migrate_stamp(struct task_struct * next) {
+    struct migrate_stamp * stamp;
+    int from_cpu;
+    
+    if (!migrate_stamps || !next->mm)
+        return -1;
+    
+    stamp = &migrate_stamps[hash_32(next->pid, STAMP_BITS)];
+    if (READ_ONCE(stamp->pid) != next->pid)
+        return -1;
+    smp_rmb();      /* Pairs with smp_wmb in probe_sched_migrate_task */
+    from_cpu = READ_ONCE(stamp->from_cpu);
+    WRITE_ONCE(stamp->pid, 0);
+    return from_cpu;
+}
+NOKPROBE_SYMBOL(take_migrate_stamp);    /* Don't probe this function */
+
+/* How far apart two CPUs are, from least to most cache lost */
+static enum migrate_kind migrate_kind(int from, int to) {
+    if (cpumask_test_cpu(to, topology_sibling_cpumask(from)))
+        return MIGRATE_CORE;
+    if (cpumask_test_cpu(to, cpu_llc_shared_mask(from)))
+        return MIGRATE_LLC;
+    if (cpu_to_node(from) == cpu_to_node(to))
+        return MIGRATE_CROSS_LLC;
+    return MIGRATE_NUMA;
+}
+NOKPROBE_SYMBOL(migrate_kind);      /* Don't probe this function */
+
+/*
+ * Whether the slice next starts now is sampled. With sample_every N,
+ * the gaps between sampled switches are uniform in [1, 2N - 1], so every
+ * switch is sampled with probability 1/N without locking onto a pattern
+ * like two tasks ping-ponging.
+ */
+static bool sample_switch(struct perftop_cpu * cpu_data, int every) {
+    if (every == 1)
+        return true;
+    if (cpu_data->countdown && --cpu_data->countdown)
+        return false;
+    cpu_data->countdown = 1 + prandom_u32_state(&cpu_data->rnd) % (2 * every - 1);
+    return true;
+}
+NOKPROBE_SYMBOL(sample_switch);     /* Don't probe this function */
+
+/* a + b, stuck at U64_MAX instead of wrapping */
+static inline u64 add_sat(u64 a, u64 b) {
+    return a + b < a ? U64_MAX : a + b;
+}
+
+/* a * b, stuck at U64_MAX instead of wrapping */
+static inline u64 mul_sat(u64 a, u64 b) {
+    u64 product;
+    
+    return check_mul_overflow(a, b, &product) ? U64_MAX : product;
+}
+
+/*
+ * Charge prev for the slice it just finished on this CPU and start
+ * next's slice. Both backends end up here once they know prev and next.
+ * Kernel threads aren't charged, but a task switched in after one
+ * still gets its slice started and its wakeup latency recorded.
+ * A task that got past sched_process_exit isn't given a new entry.
+ * Its mm is gone by then, so it isn't charged as prev either.
+ *
+ * With sample_every N above 1 only the slices started on a sampled
+ * switch are timed, and each counts as N slices and N times its tsc,
+ * which makes the totals unbiased estimates. Every sampled slice also
+ * adds its share of the estimates' variance, for the error bounds
+ * /proc/perftop shows. Other switches only consume next's wakeup stamp.
+ */
+static void account_switch(struct perftop_cpu * cpu_data, struct task_struct * prev,
+        struct task_struct * next) {
+    struct my_hash_table_struct * position;
+    unsigned long long current_tsc; /* rdtsc() */
+    int every = READ_ONCE(sample_every);
+    pid_t waker = 0;
+    s64 latency = take_wakeup_stamp(next, &waker);
+    int from_cpu = take_migrate_stamp(next);
+    bool start = sample_switch(cpu_data, every);
+    bool finish = every == 1 || cpu_data->running.pid == prev->pid;
+    u64 weight = cpu_data->running.pid == prev->pid ? cpu_data->running.weight : 1;
+    u64 elapsed, scaled;
+    
+    if (!start && !finish)
+        return;
+    
+    /* Other CPUs only work on their own perftop_cpu, the lock only keeps exits out */
+    raw_spin_lock(&cpu_data->lock);
+    write_seqcount_begin(&cpu_data->seq);
+    current_tsc = rdtsc();
+    
+    /*
+     * Work for prev. No entry or no slice start means we didn't see it
+     * being switched in (it was running at load, or came after a skipped
+     * switch), so there is nothing we can credit. Only switch-ins make
+     * entries.
+     */
+    if (finish && prev->mm) {
+        cpu_data->context_switch_counter += weight;
+        position = find_task_entry(cpu_data, prev->pid);
+        if (position && position->tsc) {
+            elapsed = current_tsc - position->tsc;
+            scaled = elapsed * weight;
+            position->ttsc += scaled;
+            position->slices += weight;
+            if (weight > 1) {
+                /* Past ~2^34 tsc at the sparsest sampling this no longer fits */
+                position->tsc_var = add_sat(position->tsc_var,
+                        mul_sat(mul_sat(elapsed >> VAR_SHIFT, elapsed >> VAR_SHIFT),
+                            weight * (weight - 1)));
+                position->slices_var += weight * (weight - 1);
+            }
+            window_add(position, window_now(), scaled);
+            account_groups(cpu_data, prev, scaled, weight);
+            position->tsc = 0;
+        }
+    }
+    
+    /* Work for next, its slice starts now */
+    position = NULL;
+    if (start && !(next->flags & PF_EXITING))
+        position = get_task_entry(cpu_data, next->pid);
+    if (position) {
+        position->tsc = current_tsc;
+        list_move_tail(&position->lru, &cpu_data->lru);
+    }
+    cpu_data->running.pid = start ? next->pid : -1;
+    cpu_data->running.weight = every;
+    cpu_data->running.start = position && next->mm ? current_tsc : 0;
+    
+    /* Moved away and back before running doesn't count */
+    if (start && from_cpu >= 0 && from_cpu < nr_cpu_ids && from_cpu != smp_processor_id()) {
+        enum migrate_kind kind = migrate_kind(from_cpu, smp_processor_id());
+        
+        cpu_data->migrations[kind] += every;
+        if (position)
+            position->migrations[kind] += every;
+    }
+    
+    if (start && latency >= 0) {
+        hist_add(&cpu_data->rq_lat, latency);
+        if (position)
+            hist_add(&position->rq_lat, latency);
+        if (smp_load_acquire(&wakegraph))
+            add_wake_edge(cpu_data, waker, next->pid, latency, every);
+    }
+    
+    write_seqcount_end(&cpu_data->seq);
+    raw_spin_unlock(&cpu_data->lock);
+}
+NOKPROBE_SYMBOL(account_switch);    /* Don't probe this function */
+
+/*
+ * on_each_cpu callback at load. Whatever was running when we attached
+ * never gets switched in for us to see, so its slice is started here
+ * instead of being lost. A task already switched in since is left alone.
+ */
+static void start_running_cpu(void * info) {
+    struct perftop_cpu * cpu_data = this_cpu_ptr(perftop_cpus);
+    struct my_hash_table_struct * position;
+    
+    if (!current->mm || cpu_data->running.pid == current->pid)
+        return;
+    
+    raw_spin_lock(&cpu_data->lock);
+    write_seqcount_begin(&cpu_data->seq);
+    position = get_task_entry(cpu_data, current->pid);
+    if (position && !position->tsc) {
+        position->tsc = rdtsc();
+        list_move_tail(&position->lru, &cpu_data->lru);
+        cpu_data->running.pid = current->pid;
+        cpu_data->running.weight = 1;   /* Already running, so it's in every sample */
+        cpu_data->running.start = position->tsc;
+    }
+    write_seqcount_end(&cpu_data->seq);
+    raw_spin_unlock(&cpu_data->lock);
+}
+
+/* Add one handler run that started at start_tsc to this CPU's self timing */
+static void time_handler(struct perftop_cpu * cpu_data, unsigned long long start_tsc) {
+    unsigned long long cycles = rdtsc() - start_tsc;
+    
+    cpu_data->handler_cycles += cycles;
+    hist_add(&cpu_data->handler_hist, cycles);
+}
+NOKPROBE_SYMBOL(time_handler);      /* Don't probe this function */
+
+/*
+ * Callback for when func_name is returned
+ */
+static int ret_pick_next_fair(struct kretprobe_instance * ri, struct pt_regs * regs) {
+    struct perftop_cpu * cpu_data = this_cpu_ptr(perftop_cpus);    /* Preemption is off in here */
+    struct my_data * data;
+    unsigned long next;
+    unsigned long long start_tsc = rdtsc();
+    
+    next = regs_return_value(regs);     /* Get return value of func_name. In our case the next task_struct **/
+
+    data = (struct my_data *)ri->data;  /* Retriveing my_data from instance */
+    
+    /* Only account if next != null, prev != null, prev != next */
+    if (data->prev != next && next != UNSIGN_LONG_NULL && data->prev != UNSIGN_LONG_NULL) {
+        unsigned int state = switch_out_state(false, (struct task_struct *)data->prev);
+        
+        account_switch(cpu_data, (struct task_struct *)data->prev, (struct task_struct *)next);
+        ring_emit((struct task_struct *)data->prev, (struct task_struct *)next, state);
+        offcpu_switch((struct task_struct *)data->prev, (struct task_struct *)next, state);
+    }
+    
+    cpu_data->post_count++;
+    time_handler(cpu_data, start_tsc);
+    return 0;
+}
+NOKPROBE_SYMBOL(ret_pick_next_fair);    /* Don't probe this function */
+
+static struct kretprobe my_kretprobe = {
+    .handler = ret_pick_next_fair,          /* The callback used when the probing function is returned */
+    .entry_handler = entry_pick_next_fair,  /* The callback used when the probing function is entered */
+    .data_size = sizeof(struct my_data),    /* No screwing around with the size, provide it! */
+    .maxactive = 8     /* How many concurrent instances of probes. At least 8 to not miss any */
+};
+
+/*
+ * sched_switch tracepoint, hit for every switch in every scheduling
+ * class with the real prev and next. The probe gained prev_state in 5.18.
+ */
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(5, 18, 0)
+static void probe_sched_switch(void * ignore, bool preempt, struct task_struct * prev,
+        struct task_struct * next, unsigned int prev_state) {
+#else
+static void probe_sched_switch(void * ignore, bool preempt, struct task_struct * prev,
+        struct task_struct * next) {
+#endif
+    struct perftop_cpu * cpu_data = this_cpu_ptr(perftop_cpus);    /* Called with preemption off */
+    unsigned long long start_tsc = rdtsc();
+    
+    /* account_switch skips charging kernel threads, like entry_pick_next_fair does */
+    if (prev != next) {
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(5, 18, 0)
+        unsigned int state = preempt ? 0 : prev_state;
+#else
+        unsigned int state = switch_out_state(preempt, prev);
+#endif
+        
+        account_switch(cpu_data, prev, next);
+        ring_emit(prev, next, state);
+        offcpu_switch(prev, next, state);
+    }
+    
+    cpu_data->switch_events++;
+    time_handler(cpu_data, start_tsc);
+}
+
+/*
+ * sched_wakeup and sched_wakeup_new, p was just put on a run queue.
+ * Runs on the waker's CPU, so the stamp goes in the shared task_stamps.
+ */
+static void probe_sched_wakeup(void * ignore, struct task_struct * p) {
+    struct task_stamp * stamp = &task_stamps[hash_32(p->pid, STAMP_BITS)];
+    
+    /* From an interrupt current is just whoever it interrupted */
+    WRITE_ONCE(stamp->waker, in_task() ? current->pid : 0);
+    WRITE_ONCE(stamp->wake_ns, ktime_get_mono_fast_ns());
+    smp_wmb();      /* waker and wake_ns have to be there before the pid claims the slot */
+    WRITE_ONCE(stamp->pid, p->pid);
+}
+
+/*
+ * sched_migrate_task, p is being moved to dest_cpu from the CPU it's
+ * assigned to now. Only stamps p, the switch in on dest_cpu counts it.
+ */
+static void probe_sched_migrate_task(void * ignore, struct task_struct * p, int dest_cpu) {
+    struct migrate_stamp * stamp = &migrate_stamps[hash_32(p->pid, STAMP_BITS)];
+    
+    if (!p->mm || READ_ONCE(stamp->pid) == p->pid)
+        return;
+    WRITE_ONCE(stamp->from_cpu, task_cpu(p));
+    smp_wmb();      /* from_cpu has to be there before the pid claims the slot */
+    WRITE_ONCE(stamp->pid, p->pid);
+}
+
+/*
+ * Called in do_exit. p's entries on every CPU are folded into that
+ * CPU's exited totals and freed, and so are its process's entries once
+ * the last thread exits. A process's time stays in exited through its
+ * tasks.
+ */
+static void probe_sched_process_exit(void * ignore, struct task_struct * p) {
+    struct perftop_cpu * cpu_data;
+    struct my_hash_table_struct * position;
+    struct group_entry * group;
+    bool group_dead = !atomic_read(&p->signal->live);
+    unsigned long flags;
+    int cpu;
+    
+    for_each_possible_cpu(cpu) {
+        cpu_data = per_cpu_ptr(perftop_cpus, cpu);
+        
+        raw_spin_lock_irqsave(&cpu_data->lock, flags);
+        write_seqcount_begin(&cpu_data->seq);
+        position = find_task_entry(cpu_data, p->pid);
+        if (position)
+            retire_entry(cpu_data, &cpu_data->exited, position);
+        
+        if (group_dead) {
+            hash_for_each_possible(cpu_data->tgids, group, hash_list, p->tgid) {
+                if (group->id == p->tgid)
+                    break;
+            }
+            if (group)
+                drop_group_entry(group);
+        }
+        write_seqcount_end(&cpu_data->seq);
+        raw_spin_unlock_irqrestore(&cpu_data->lock, flags);
+        
+        /* We're in do_exit, not under the rq lock, so the work can be queued directly */
+        if (position)
+            schedule_work(&cpu_data->tasks_work);
+    }
+}
+
+#if defined(CONFIG_CGROUPS) && LINUX_VERSION_CODE >= KERNEL_VERSION(5, 5, 0)
+/*
+ * Called when a cgroup's directory is removed, by then no task is left
+ * in it to be charged. Its entries on every CPU are freed.
+ */
+static void probe_cgroup_rmdir(void * ignore, struct cgroup * cgrp, const char * path) {
+    struct perftop_cpu * cpu_data;
+    struct group_entry * group;
+    u64 id = cgroup_id(cgrp);
+    unsigned long flags;
+    int cpu;
+    
+    for_each_possible_cpu(cpu) {
+        cpu_data = per_cpu_ptr(perftop_cpus, cpu);
+        
+        raw_spin_lock_irqsave(&cpu_data->lock, flags);
+        write_seqcount_begin(&cpu_data->seq);
+        hash_for_each_possible(cpu_data->cgroups, group, hash_list, id) {
+            if (group->id == id)
+                break;
+        }
+        if (group)
+            drop_group_entry(group);
+        write_seqcount_end(&cpu_data->seq);
+        raw_spin_unlock_irqrestore(&cpu_data->lock, flags);
+    }
+}
+#endif
+
+/* Used with for_each_kernel_tracepoint to look a tracepoint up by name */
+struct tracepoint_lookup {
+    const char * name;
+    struct tracepoint * tp;
+};
+
+static void match_tracepoint(struct tracepoint * tp, void * priv) {
+    struct tracepoint_lookup * lookup = priv;
+    
+    if (!strcmp(tp->name, lookup->name))
+        lookup->tp = tp;
+}
+
+static struct tracepoint * find_tracepoint(const char * name) {
+    struct tracepoint_lookup lookup = { .name = name, .tp = NULL };
+    
+    for_each_kernel_tracepoint(match_tracepoint, &lookup);
+    return lookup.tp;
+}
+
+/*
+ * kallsyms_lookup_name isn't exported since 5.7, but registering a
+ * kprobe on it tells us where it is. Returns 0 if name can't be found.
+ */
+static unsigned long lookup_symbol(const char * name) {
+    static unsigned long (*lookup_name)(const char * name);
+    struct kprobe kp = { .symbol_name = "kallsyms_lookup_name" };
+    
+    if (!lookup_name) {
+        if (register_kprobe(&kp) < 0)
+            return 0;
+        lookup_name = (unsigned long (*)(const char *))kp.addr;
+        unregister_kprobe(&kp);
+    }
+    return lookup_name(name);
+}
+
+/*
+ * Record the stack of whatever the timer interrupted on this CPU.
+ * Runs in hard irq context.
+ */
+static void record_stack(struct sampler_cpu * sc, struct pt_regs * regs) {
+    struct stack_sample * sample = &sc->scratch;
+    struct stack_sample * position;
+    unsigned int nr, i;
+    
+    sample->nr_kernel = 0;
+    sample->nr_user = 0;
+    
+    if (!regs || !user_mode(regs)) {
+        /*
+         * The unwind starts in this handler and goes through the irq
+         * entry into the interrupted code, so drop everything above
+         * the interrupted ip.
+         */
+        nr = stack_trace_save(sample->ips, STACK_DEPTH, 0);
+        for (i = 0; regs && i < nr; i++) {
+            if (sample->ips[i] == instruction_pointer(regs))
+                break;
+        }
+        if (i == nr)
+            i = 0;
+        memmove(sample->ips, sample->ips + i, (nr - i) * sizeof(unsigned long));
+        sample->nr_kernel = nr - i;
+    }
+    
+    if (current->mm && !(current->flags & PF_KTHREAD) && save_user_stack)
+        sample->nr_user = save_user_stack(sample->ips + sample->nr_kernel, STACK_DEPTH);
+    
+    nr = sample->nr_kernel + sample->nr_user;
+    sample->tgid = current->tgid;
+    sample->hash = jhash(sample->ips, nr * sizeof(unsigned long),
+            sample->tgid ^ (sample->nr_kernel << 16));
+    
+    hash_for_each_possible(sc->stacks, position, hash_list, sample->hash) {
+        if (position->hash == sample->hash && position->tgid == sample->tgid &&
+                position->nr_kernel == sample->nr_kernel && position->nr_user == sample->nr_user &&
+                !memcmp(position->ips, sample->ips, nr * sizeof(unsigned long))) {
+            WRITE_ONCE(position->count, position->count + 1);
+            return;
+        }
+    }
+    
+    if (sc->used == STACK_POOL_SIZE) {
+        sc->dropped++;
+        return;
+    }
+    
+    /* New stack, fill in the entry before publishing it through used */
+    position = &sc->pool[sc->used];
+    position->hash = sample->hash;
+    position->tgid = sample->tgid;
+    position->nr_kernel = sample->nr_kernel;
+    position->nr_user = sample->nr_user;
+    position->count = 1;
+    memcpy(position->comm, current->comm, TASK_COMM_LEN);
+    memcpy(position->ips, sample->ips, nr * sizeof(unsigned long));
+    hash_add(sc->stacks, &position->hash_list, position->hash);
+    smp_store_release(&sc->used, sc->used + 1);
+}
+
+static enum hrtimer_restart sample_stack(struct hrtimer * timer) {
+    struct sampler_cpu * sc = container_of(timer, struct sampler_cpu, timer);
+    unsigned long long start_tsc = rdtsc();
+    
+    sc->samples++;
+    if (is_idle_task(current))
+        sc->idle++;
+    else
+        record_stack(sc, get_irq_regs());
+    
+    hrtimer_forward_now(timer, ns_to_ktime(sample_period_ns));
+    sc->cycles += rdtsc() - start_tsc;
+    return HRTIMER_RESTART;
+}
+
+/* on_each_cpu callback, the timer has to be started on the CPU it is pinned to */
+static void start_sampler_cpu(void * info) {
+    struct sampler_cpu * sc = this_cpu_ptr(sampler_cpus);
+    
+    hrtimer_start(&sc->timer, ns_to_ktime(sample_period_ns), HRTIMER_MODE_REL_PINNED_HARD);
+}
+
+/*
+ * Start sampling every online CPU hz times a second, or stop when hz
+ * is 0. Starting again throws away the stacks of the previous run.
+ */
+static int set_sample_hz(int hz) {
+    struct sampler_cpu * sc;
+    int cpu;
+    
+    if (hz < 0 || hz > MAX_SAMPLE_HZ)
+        return -EINVAL;
+    
+    mutex_lock(&sampler_mutex);
+    for_each_possible_cpu(cpu)
+        hrtimer_cancel(&per_cpu_ptr(sampler_cpus, cpu)->timer);
+    WRITE_ONCE(sample_hz, 0);
+    
+    if (!hz) {
+        mutex_unlock(&sampler_mutex);
+        return 0;
+    }
+    
+    for_each_possible_cpu(cpu) {
+        sc = per_cpu_ptr(sampler_cpus, cpu);
+        if (!sc->pool) {
+            sc->pool = kvmalloc_array(STACK_POOL_SIZE, sizeof(struct stack_sample), GFP_KERNEL);
+            if (!sc->pool) {
+                mutex_unlock(&sampler_mutex);
+                return -ENOMEM;
+            }
+        }
+        hash_init(sc->stacks);
+        sc->used = 0;
+        sc->samples = 0;
+        sc->idle = 0;
+        sc->dropped = 0;
+        sc->cycles = 0;
+    }
+    
+    sample_period_ns = NSEC_PER_SEC / hz;
+    WRITE_ONCE(sample_hz, hz);
+    on_each_cpu(start_sampler_cpu, NULL, 1);
+    mutex_unlock(&sampler_mutex);
+    return 0;
+}
+
+/*
+ * Folded stacks, one "comm-tgid;outermost;...;innermost count" line per
+ * stack per CPU, ready for flamegraph.pl (which adds up repeated lines).
+ * Kernel frames are symbolized, user frames are raw addresses.
+ */
+static int perftop_stacks_show(struct seq_file * m, void * v) {
+    struct sampler_cpu * sc;
+    struct stack_sample * sample;
+    int cpu, used, i, j;
+    
+    mutex_lock(&sampler_mutex);
+    for_each_possible_cpu(cpu) {
+        sc = per_cpu_ptr(sampler_cpus, cpu);
+        if (!sc->pool)
+            continue;
+        
+        used = smp_load_acquire(&sc->used);
+        for (i = 0; i < used; i++) {
+            sample = &sc->pool[i];
+            
+            seq_printf(m, "%.*s-%d", TASK_COMM_LEN, sample->comm, sample->tgid);
+            for (j = sample->nr_kernel + sample->nr_user - 1; j >= sample->nr_kernel; j--)
+                seq_printf(m, ";0x%lx", sample->ips[j]);
+            for (; j >= 0; j--)
+                seq_printf(m, ";%ps", (void *)sample->ips[j]);
+            seq_printf(m, " %llu\n", READ_ONCE(sample->count));
+        }
+    }
+    mutex_unlock(&sampler_mutex);
+    return 0;
+}
+
+static int perftop_stacks_open(struct inode * inode, struct file * file) {
+    return single_open(file, perftop_stacks_show, NULL);
+}
+
+/* struct that define the callbacks for /proc/perftop_stacks */
+static const struct proc_ops perftop_stacks_proc_ops = {
+    .proc_open = perftop_stacks_open,
+    .proc_read = seq_read,
+    .proc_lseek = seq_lseek,
+    .proc_release = single_release
+};
+
+/* Set up every CPU's timer, sampling is started later by set_sample_hz */
+static int sampler_init(void) {
+    struct sampler_cpu * sc;
+    int cpu;
+    
+    sampler_cpus = alloc_percpu(struct sampler_cpu);
+    if (!sampler_cpus)
+        return -ENOMEM;
+    
+    for_each_possible_cpu(cpu) {
+        sc = per_cpu_ptr(sampler_cpus, cpu);
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(6, 13, 0)
+        hrtimer_setup(&sc->timer, sample_stack, CLOCK_MONOTONIC, HRTIMER_MODE_REL_PINNED_HARD);
+#else
+        hrtimer_init(&sc->timer, CLOCK_MONOTONIC, HRTIMER_MODE_REL_PINNED_HARD);
+        sc->timer.function = sample_stack;
+#endif
+    }
+    
+    save_user_stack = (void *)lookup_symbol("stack_trace_save_user");
+    if (!save_user_stack)
+        printk(KERN_INFO "stack_trace_save_user not found, sampling kernel stacks only\n");
+    return 0;
+}
+
+static void sampler_exit(void) {
+    int cpu;
+    
+    set_sample_hz(0);
+    for_each_possible_cpu(cpu)
+        kvfree(per_cpu_ptr(sampler_cpus, cpu)->pool);
+    free_percpu(sampler_cpus);
+}
+
+/*
+ * Start (on is 1) or stop (0) off-CPU profiling. Starting again throws
+ * away what the previous run recorded. The switch handlers run with
+ * preemption off, so once synchronize_rcu returns none of them can
+ * still be using the pools or stamps we reset.
+ */
+static int set_offcpu(int on) {
+    struct offcpu_cpu * oc;
+    int cpu;
+    
+    if (on != 0 && on != 1)
+        return -EINVAL;
+    
+    mutex_lock(&offcpu_mutex);
+    WRITE_ONCE(offcpu, 0);
+    synchronize_rcu();
+    
+    if (!on) {
+        mutex_unlock(&offcpu_mutex);
+        return 0;
+    }
+    
+    for_each_possible_cpu(cpu) {
+        oc = per_cpu_ptr(offcpu_cpus, cpu);
+        if (!oc->pool) {
+            oc->pool = kvmalloc_array(OFFCPU_POOL_SIZE, sizeof(struct offcpu_stack), GFP_KERNEL);
+            if (!oc->pool) {
+                mutex_unlock(&offcpu_mutex);
+                return -ENOMEM;
+            }
+        }
+        hash_init(oc->stacks);
+        oc->used = 0;
+        oc->dropped = 0;
+    }
+    memset(offcpu_stamps, 0, sizeof(struct offcpu_stamp) << STAMP_BITS);
+    
+    smp_store_release(&offcpu, 1);
+    mutex_unlock(&offcpu_mutex);
+    return 0;
+}
+
+/* Orders pool entries so the same task and stack on different CPUs end up next to each other */
+static int cmp_offcpu_key(const void * a, const void * b) {
+    const struct offcpu_stack * x = *(struct offcpu_stack * const *)a;
+    const struct offcpu_stack * y = *(struct offcpu_stack * const *)b;
+    int ret;
+    
+    if (x->hash != y->hash)
+        return x->hash < y->hash ? -1 : 1;
+    if (x->pid != y->pid)
+        return x->pid < y->pid ? -1 : 1;
+    if (x->nr != y->nr)
+        return x->nr < y->nr ? -1 : 1;
+    if ((ret = memcmp(x->comm, y->comm, TASK_COMM_LEN)))
+        return ret;
+    return memcmp(x->ips, y->ips, x->nr * sizeof(unsigned long));
+}
+
+/* Most blocked time first */
+static int cmp_offcpu_desc(const void * a, const void * b) {
+    const struct offcpu_total * x = a, * y = b;
+    
+    if (x->blocked_ns == y->blocked_ns)
+        return 0;
+    return x->blocked_ns > y->blocked_ns ? -1 : 1;
+}
+
+/*
+ * Off-CPU stacks, one "comm-pid;outermost;...;innermost us" line per
+ * task and stack, added up over every CPU it blocked on, most blocked
+ * time first, so the head of the file is the top blocking reasons and
+ * the whole of it works as input for flamegraph.pl. Time still being
+ * blocked shows up once the task is switched back in.
+ */
+static int perftop_offcpu_show(struct seq_file * m, void * v) {
+    struct offcpu_cpu * oc;
+    struct offcpu_stack ** sorted;
+    struct offcpu_stack * stack;
+    struct offcpu_total * totals = NULL, * total = NULL;
+    int count = 0, merged = 0;
+    int cpu, used, i, j;
+    
+    mutex_lock(&offcpu_mutex);
+    if (!READ_ONCE(offcpu)) {
+        mutex_unlock(&offcpu_mutex);
+        seq_printf(m, "Off-CPU profiling is off, write offcpu=1 to /proc/perftop\n");
+        return 0;
+    }
+    
+    for_each_possible_cpu(cpu)
+        count += smp_load_acquire(&per_cpu_ptr(offcpu_cpus, cpu)->used);
+    sorted = kvmalloc_array(count ? count : 1, sizeof(struct offcpu_stack *), GFP_KERNEL);
+    if (!sorted) {
+        mutex_unlock(&offcpu_mutex);
+        return -ENOMEM;
+    }
+    
+    /* Stacks added since we counted are left for the next read */
+    i = 0;
+    for_each_possible_cpu(cpu) {
+        oc = per_cpu_ptr(offcpu_cpus, cpu);
+        used = smp_load_acquire(&oc->used);
+        for (j = 0; j < used && i < count; j++)
+            sorted[i++] = &oc->pool[j];
+    }
+    count = i;
+    sort(sorted, count, sizeof(struct offcpu_stack *), cmp_offcpu_key, NULL);
+    
+    for (i = 0; i < count; i++) {
+        if (!i || cmp_offcpu_key(&sorted[i - 1], &sorted[i]))
+            merged++;
+    }
+    if (merged)
+        totals = kvmalloc_array(merged, sizeof(struct offcpu_total), GFP_KERNEL);
+    if (merged && !totals) {
+        mutex_unlock(&offcpu_mutex);
+        kvfree(sorted);
+        return -ENOMEM;
+    }
+    
+    for (i = 0; i < count; i++) {
+        stack = sorted[i];
+        if (!i || cmp_offcpu_key(&sorted[i - 1], &sorted[i])) {
+            total = total ? total + 1 : totals;
+            total->pid = stack->pid;
+            memcpy(total->comm, stack->comm, TASK_COMM_LEN);
+            total->nr = stack->nr;
+            total->ips = stack->ips;
+            total->blocked_ns = 0;
+            total->blocks = 0;
+        }
+        total->blocked_ns += atomic64_read(&stack->blocked_ns);
+        total->blocks += atomic64_read(&stack->blocks);
+    }
+    sort(totals, merged, sizeof(struct offcpu_total), cmp_offcpu_desc, NULL);
+    
+    for (i = 0; i < merged; i++) {
+        total = &totals[i];
+        if (!total->blocks)
+            continue;   /* Still blocked the first time */
+        seq_printf(m, "%.*s-%d", TASK_COMM_LEN, total->comm, total->pid);
+        for (j = total->nr - 1; j >= 0; j--)
+            seq_printf(m, ";%ps", (void *)total->ips[j]);
+        seq_printf(m, " %llu\n", total->blocked_ns / NSEC_PER_USEC);
+    }
+    mutex_unlock(&offcpu_mutex);
+    kvfree(totals);
+    kvfree(sorted);
+    return 0;
+}
+
+static int perftop_offcpu_open(struct inode * inode, struct file * file) {
+    return single_open(file, perftop_offcpu_show, NULL);
+}
+
+/* struct that define the callbacks for /proc/perftop_offcpu */
+static const struct proc_ops perftop_offcpu_proc_ops = {
+    .proc_open = perftop_offcpu_open,
+    .proc_read = seq_read,
+    .proc_lseek = seq_lseek,
+    .proc_release = single_release
+};
+
+/* Off-CPU profiling is started later by set_offcpu */
+static int offcpu_init(void) {
+    offcpu_cpus = alloc_percpu(struct offcpu_cpu);
+    offcpu_stamps = vzalloc(sizeof(struct offcpu_stamp) << STAMP_BITS);
+    if (!offcpu_cpus || !offcpu_stamps) {
+        free_percpu(offcpu_cpus);
+        vfree(offcpu_stamps);
+        return -ENOMEM;
+    }
+    return 0;
+}
+
+/* Called once the switch backend is detached */
+static void offcpu_exit(void) {
+    int cpu;
+    
+    for_each_possible_cpu(cpu)
+        kvfree(per_cpu_ptr(offcpu_cpus, cpu)->pool);
+    free_percpu(offcpu_cpus);
+    vfree(offcpu_stamps);
+}
+
+/*
+ * Start (on is 1) or stop (0) aggregating wakeups by waker and wakee.
+ * Needs the wakeup tracepoints. Starting again throws away the edges
+ * of the previous run, see set_offcpu for why synchronize_rcu is enough.
+ */
+static int set_wakegraph(int on) {
+    struct perftop_cpu * cpu_data;
+    int cpu;
+    
+    if (on != 0 && on != 1)
+        return -EINVAL;
+    if (on && !wakeup_attached)
+        return -ENODEV;
+    
+    mutex_lock(&wakegraph_mutex);
+    WRITE_ONCE(wakegraph, 0);
+    synchronize_rcu();
+    
+    if (!on) {
+        mutex_unlock(&wakegraph_mutex);
+        return 0;
+    }
+    
+    for_each_possible_cpu(cpu) {
+        cpu_data = per_cpu_ptr(perftop_cpus, cpu);
+        if (!cpu_data->edges) {
+            cpu_data->edges = kvmalloc_array(WAKE_EDGES, sizeof(struct wake_edge), GFP_KERNEL);
+            if (!cpu_data->edges) {
+                mutex_unlock(&wakegraph_mutex);
+                return -ENOMEM;
+            }
+        }
+        hash_init(cpu_data->edge_table);
+        cpu_data->nr_edges = 0;
+        cpu_data->edges_dropped = 0;
+    }
+    
+    smp_store_release(&wakegraph, 1);
+    mutex_unlock(&wakegraph_mutex);
+    return 0;
+}
+
+/* Orders edges by waker then wakee, so copies of one edge end up next to each other */
+static int cmp_edge_pids(const void * a, const void * b) {
+    const struct wake_edge * x = a, * y = b;
+    
+    if (x->waker != y->waker)
+        return x->waker < y->waker ? -1 : 1;
+    if (x->wakee != y->wakee)
+        return x->wakee < y->wakee ? -1 : 1;
+    return 0;
+}
+
+/* Most total wait first */
+static int cmp_edge_wait_desc(const void * a, const void * b) {
+    const struct wake_edge * x = a, * y = b;
+    
+    if (x->wait_ns == y->wait_ns)
+        return 0;
+    return x->wait_ns > y->wait_ns ? -1 : 1;
+}
+
+/* Name of pid in comm, "[irq]" for 0 and "?" if it's gone */
+static void pid_comm(pid_t pid, char * comm) {
+    struct task_struct * task = NULL;
+    struct pid * found;
+    
+    if (!pid) {
+        strscpy(comm, "[irq]", TASK_COMM_LEN);
+        return;
+    }
+    
+    found = find_get_pid(pid);
+    if (found) {
+        task = get_pid_task(found, PIDTYPE_PID);
+        put_pid(found);
+    }
+    if (!task) {
+        strscpy(comm, "?", TASK_COMM_LEN);
+        return;
+    }
+    strscpy(comm, task->comm, TASK_COMM_LEN);
+    put_task_struct(task);
+}
+
+/*
+ * The wakeup graph as an edge list, one "waker-pid -> wakee-pid" line
+ * per edge with its wakeups and how long the wakee waited to run after
+ * them, the edges costing the most total wait first. Every CPU's copy
+ * of an edge is merged into one line.
+ */
+static int perftop_wakeups_show(struct seq_file * m, void * v) {
+    struct perftop_cpu * cpu_data;
+    struct wake_edge * edges, * edge;
+    char waker_comm[TASK_COMM_LEN], wakee_comm[TASK_COMM_LEN];
+    u64 dropped = 0;
+    int count = 0, merged = 0;
+    int cpu, used, i, j;
+    
+    mutex_lock(&wakegraph_mutex);
+    if (!READ_ONCE(wakegraph)) {
+        mutex_unlock(&wakegraph_mutex);
+        seq_printf(m, "Wakeup graph is off, write wakegraph=1 to /proc/perftop\n");
+        return 0;
+    }
+    
+    for_each_possible_cpu(cpu)
+        count += smp_load_acquire(&per_cpu_ptr(perftop_cpus, cpu)->nr_edges);
+    edges = kvmalloc_array(count ? count : 1, sizeof(struct wake_edge), GFP_KERNEL);
+    if (!edges) {
+        mutex_unlock(&wakegraph_mutex);
+        return -ENOMEM;
+    }
+    
+    /* Edges added since we counted are left for the next read */
+    i = 0;
+    for_each_possible_cpu(cpu) {
+        cpu_data = per_cpu_ptr(perftop_cpus, cpu);
+        used = smp_load_acquire(&cpu_data->nr_edges);
+        for (j = 0; j < used && i < count; j++)
+            snapshot(cpu_data, &edges[i++], &cpu_data->edges[j], sizeof(struct wake_edge));
+        dropped += READ_ONCE(cpu_data->edges_dropped);
+    }
+    mutex_unlock(&wakegraph_mutex);
+    count = i;
+    
+    sort(edges, count, sizeof(struct wake_edge), cmp_edge_pids, NULL);
+    for (i = 0; i < count; i++) {
+        if (merged && !cmp_edge_pids(&edges[merged - 1], &edges[i])) {
+            edge = &edges[merged - 1];
+            edge->wakeups += edges[i].wakeups;
+            edge->wait_ns += edges[i].wait_ns;
+            hist_merge(&edge->lat, &edges[i].lat);
+        }
+        else if (merged++ != i) {
+            edges[merged - 1] = edges[i];
+        }
+    }
+    sort(edges, merged, sizeof(struct wake_edge), cmp_edge_wait_desc, NULL);
+    
+    if (dropped)
+        seq_printf(m, "Edges that didn't fit: %llu\n", dropped);
+    for (i = 0; i < merged; i++) {
+        edge = &edges[i];
+        pid_comm(edge->waker, waker_comm);
+        pid_comm(edge->wakee, wakee_comm);
+        seq_printf(m, "%s-%d -> %s-%d Wakeups: %llu Wait: %llu us Avg: %llu p50: %llu p99: %llu max: %llu us\n",
+                waker_comm, edge->waker, wakee_comm, edge->wakee, edge->wakeups,
+                edge->wait_ns / NSEC_PER_USEC,
+                div64_u64(edge->wait_ns, edge->wakeups ? : 1) / NSEC_PER_USEC,
+                hist_percentile(&edge->lat, 50) / NSEC_PER_USEC,
+                hist_percentile(&edge->lat, 99) / NSEC_PER_USEC, edge->lat.max / NSEC_PER_USEC);
+    }
+    kvfree(edges);
+    return 0;
+}
+
+static int perftop_wakeups_open(struct inode * inode, struct file * file) {
+    return single_open(file, perftop_wakeups_show, NULL);
+}
+
+/* struct that define the callbacks for /proc/perftop_wakeups */
+static const struct proc_ops perftop_wakeups_proc_ops = {
+    .proc_open = perftop_wakeups_open,
+    .proc_read = seq_read,
+    .proc_lseek = seq_lseek,
+    .proc_release = single_release
+};
+
+/* Kernel time taken by one call, carried from entry to return */
+struct func_call {
+    u64 start_ns;
+};
+
+/* Entry handler for every function in func_probes */
+static int func_entry(struct kretprobe_instance * ri, struct pt_regs * regs) {
+    struct func_call * call = (struct func_call *)ri->data;
+    
+    call->start_ns = ktime_get_mono_fast_ns();
+    return 0;
+}
+NOKPROBE_SYMBOL(func_entry);    /* Don't probe this function */
+
+/* Return handler, kretprobe handlers run with preemption off so this CPU's stats are ours */
+static int func_return(struct kretprobe_instance * ri, struct pt_regs * regs) {
+    struct func_call * call = (struct func_call *)ri->data;
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(5, 11, 0)
+    struct func_probe * probe = container_of(get_kretprobe(ri), struct func_probe, rp);
+#else
+    struct func_probe * probe = container_of(ri->rp, struct func_probe, rp);
+#endif
+    struct func_cpu * stats = this_cpu_ptr(probe->stats);
+    u64 ns = ktime_get_mono_fast_ns() - call->start_ns;
+    
+    hist_add(&stats->hist, ns);
+    stats->total_ns += ns;
+    return 0;
+}
+NOKPROBE_SYMBOL(func_return);   /* Don't probe this function */
+
+/* Unregister and free every probe in func_probes, called with funcs_mutex held */
+static void detach_funcs(void) {
+    struct func_probe * probe;
+    int i;
+    
+    for (i = 0; i < nr_func_probes; i++) {
+        probe = func_probes[i];
+        unregister_kretprobe(&probe->rp);   /* Waits for running handlers */
+        free_percpu(probe->stats);
+        kfree(probe);
+    }
+    nr_func_probes = 0;
+    funcs[0] = '\0';
+}
+
+/*
+ * Replace the profiled functions with the comma separated symbols in
+ * list, an empty list just stops profiling. Either every symbol gets
+ * probed or none do.
+ */
+static int set_funcs(const char * list) {
+    struct func_probe * probe;
+    char * name;
+    char * cursor;
+    char names[sizeof(funcs)];      /* list is cut up in here, it may be funcs itself */
+    int len = 0;
+    int ret = 0;
+    int i;
+    
+    if (strscpy(names, list, sizeof(names)) < 0)
+        return -EINVAL;
+    
+    mutex_lock(&funcs_mutex);
+    detach_funcs();
+    
+    cursor = names;
+    while ((name = strsep(&cursor, ","))) {
+        if (!*name)
+            continue;
+        if (nr_func_probes == MAX_FUNCS || strlen(name) >= KSYM_NAME_LEN) {
+            ret = -EINVAL;
+            goto fail;
+        }
+        
+        probe = kzalloc(sizeof(struct func_probe), GFP_KERNEL);
+        if (!probe) {
+            ret = -ENOMEM;
+            goto fail;
+        }
+        probe->stats = alloc_percpu(struct func_cpu);
+        if (!probe->stats) {
+            kfree(probe);
+            ret = -ENOMEM;
+            goto fail;
+        }
+        strscpy(probe->name, name, KSYM_NAME_LEN);
+        probe->rp.kp.symbol_name = probe->name;
+        probe->rp.entry_handler = func_entry;
+        probe->rp.handler = func_return;
+        probe->rp.data_size = sizeof(struct func_call);
+        probe->rp.maxactive = 4 * num_possible_cpus();     /* Functions that sleep stay active long */
+        
+        if ((ret = register_kretprobe(&probe->rp))) {
+            printk(KERN_ERR "Couldn't probe %s, returned %d\n", name, ret);
+            free_percpu(probe->stats);
+            kfree(probe);
+            goto fail;
+        }
+        func_probes[nr_func_probes++] = probe;
+    }
+    
+    /* What is actually probed, for the module parameter */
+    for (i = 0; i < nr_func_probes; i++)
+        len += scnprintf(funcs + len, sizeof(funcs) - len, "%s%s", i ? "," : "", func_probes[i]->name);
+    mutex_unlock(&funcs_mutex);
+    return 0;
+
+fail:
+    detach_funcs();
+    mutex_unlock(&funcs_mutex);
+    return ret;
+}
+
+/*
+ * Function that writes /proc/perftop_funcs, every profiled function's
+ * calls and latency summed over all CPUs, with its log2 histogram.
+ */
+static int perftop_funcs_show(struct seq_file * m, void * v) {
+    struct func_probe * probe;
+    struct func_cpu * stats;
+    struct lat_hist hist;
+    u64 total_ns;
+    int cpu, i, b;
+    
+    mutex_lock(&funcs_mutex);
+    if (!nr_func_probes)
+        seq_printf(m, "No functions profiled, write funcs=<symbol>,<symbol> to /proc/perftop\n");
+    
+    for (i = 0; i < nr_func_probes; i++) {
+        probe = func_probes[i];
+        memset(&hist, 0, sizeof(struct lat_hist));
+        total_ns = 0;
+        for_each_possible_cpu(cpu) {
+            stats = per_cpu_ptr(probe->stats, cpu);
+            hist_merge(&hist, &stats->hist);
+            total_ns += READ_ONCE(stats->total_ns);
+        }
+        
+        seq_printf(m, "Function: %s Calls: %llu Avg: %llu ns p50: %llu p99: %llu max: %llu ns Missed: %d\n",
+                probe->name, hist.total, hist.total ? div64_u64(total_ns, hist.total) : 0,
+                hist_percentile(&hist, 50), hist_percentile(&hist, 99), hist.max,
+                probe->rp.nmissed);
+        for (b = 0; b < LAT_BUCKETS; b++) {
+            if (!hist.count[b])
+                continue;
+            if (b == LAT_BUCKETS - 1)
+                seq_printf(m, "  [%llu, inf) ns: %u\n", 1ULL << (b - 1), hist.count[b]);
+            else
+                seq_printf(m, "  [%llu, %llu) ns: %u\n", b ? 1ULL << (b - 1) : 0,
+                        1ULL << b, hist.count[b]);
+        }
+    }
+    mutex_unlock(&funcs_mutex);
+    return 0;
+}
+
+static int perftop_funcs_open(struct inode * inode, struct file * file) {
+    return single_open(file, perftop_funcs_show, NULL);
+}
+
+/* struct that define the callbacks for /proc/perftop_funcs */
+static const struct proc_ops perftop_funcs_proc_ops = {
+    .proc_open = perftop_funcs_open,
+    .proc_read = seq_read,
+    .proc_lseek = seq_lseek,
+    .proc_release = single_release
+};
+
+/*
+ * Entry of a lock slow path. The return address on the stack is the
+ * caller of the slow path, the frames from there up make the call site.
+ * Our own and the kprobe frames below it are skipped.
+ */
+static int lock_entry(struct kretprobe_instance * ri, struct pt_regs * regs) {
+    struct lock_call * call = (struct lock_call *)ri->data;
+    unsigned long ret = *(unsigned long *)kernel_stack_pointer(regs);
+    unsigned long ips[LOCK_SITE_DEPTH + 16];
+    unsigned int nr, i;
+    
+    nr = stack_trace_save(ips, ARRAY_SIZE(ips), 0);
+    for (i = 0; i < nr && ips[i] != ret; i++)
+        ;
+    if (i == nr) {
+        /* Unwinder didn't get there, the caller alone will have to do */
+        call->ips[0] = ret;
+        call->nr = 1;
+    }
+    else {
+        call->nr = min_t(unsigned int, nr - i, LOCK_SITE_DEPTH);
+        memcpy(call->ips, ips + i, call->nr * sizeof(unsigned long));
+    }
+    call->start_ns = ktime_get_mono_fast_ns();
+    return 0;
+}
+NOKPROBE_SYMBOL(lock_entry);    /* Don't probe this function */
+
+/*
+ * Return of a lock slow path, the lock is held now. Charged to the CPU
+ * we return on, which for sleeping locks needn't be the one we entered
+ * on. Interrupts go off so a spin slow path in an interrupt can't find
+ * this CPU's pool half updated.
+ */
+static int lock_return(struct kretprobe_instance * ri, struct pt_regs * regs) {
+    struct lock_call * call = (struct lock_call *)ri->data;
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(5, 11, 0)
+    struct lock_probe * probe = container_of(get_kretprobe(ri), struct lock_probe, rp);
+#else
+    struct lock_probe * probe = container_of(ri->rp, struct lock_probe, rp);
+#endif
+    u64 ns = ktime_get_mono_fast_ns() - call->start_ns;
+    struct lock_cpu * lc;
+    struct lock_site * position;
+    unsigned long flags;
+    u32 hash = jhash(call->ips, call->nr * sizeof(unsigned long), probe->kind);
+    
+    local_irq_save(flags);
+    lc = this_cpu_ptr(lock_cpus);
+    hash_for_each_possible(lc->sites, position, hash_list, hash) {
+        if (position->hash == hash && position->kind == probe->kind && position->nr == call->nr &&
+                !memcmp(position->ips, call->ips, call->nr * sizeof(unsigned long)))
+            goto found;
+    }
+    
+    if (lc->used == LOCK_SITES) {
+        lc->dropped++;
+        goto out;
+    }
+    
+    /* New site, fill in the entry before publishing it through used */
+    position = &lc->pool[lc->used];
+    position->hash = hash;
+    position->kind = probe->kind;
+    position->nr = call->nr;
+    memcpy(position->ips, call->ips, call->nr * sizeof(unsigned long));
+    position->contended = 0;
+    position->wait_ns = 0;
+    memset(&position->hist, 0, sizeof(struct lat_hist));
+    hash_add(lc->sites, &position->hash_list, hash);
+    smp_store_release(&lc->used, lc->used + 1);
+    
+found:
+    WRITE_ONCE(position->contended, position->contended + 1);
+    WRITE_ONCE(position->wait_ns, position->wait_ns + ns);
+    hist_add(&position->hist, ns);
+out:
+    local_irq_restore(flags);
+    return 0;
+}
+NOKPROBE_SYMBOL(lock_return);   /* Don't probe this function */
+
+/* Unregister every lock probe, called with locks_mutex held */
+static void detach_locks(void) {
+    int i;
+    
+    for (i = 0; i < LOCK_KINDS; i++) {
+        if (lock_probes[i].registered)
+            unregister_kretprobe(&lock_probes[i].rp);   /* Waits for running handlers */
+        lock_probes[i].registered = false;
+    }
+    WRITE_ONCE(locks, 0);
+}
+
+/*
+ * Start (on is 1) or stop (0) profiling lock contention. Kinds whose
+ * slow path can't be found or probed are left out, failing only if
+ * none could be. Starting again throws away the previous run's sites.
+ */
+static int set_locks(int on) {
+    struct lock_probe * probe;
+    struct lock_cpu * lc;
+    int attached = 0;
+    int cpu, i, j;
+    
+    if (on != 0 && on != 1)
+        return -EINVAL;
+    
+    mutex_lock(&locks_mutex);
+    detach_locks();
+    if (!on) {
+        mutex_unlock(&locks_mutex);
+        return 0;
+    }
+    
+    for_each_possible_cpu(cpu) {
+        lc = per_cpu_ptr(lock_cpus, cpu);
+        if (!lc->pool) {
+            lc->pool = kvmalloc_array(LOCK_SITES, sizeof(struct lock_site), GFP_KERNEL);
+            if (!lc->pool) {
+                mutex_unlock(&locks_mutex);
+                return -ENOMEM;
+            }
+        }
+        hash_init(lc->sites);
+        lc->used = 0;
+        lc->dropped = 0;
+    }
+    
+    for (i = 0; i < LOCK_KINDS; i++) {
+        probe = &lock_probes[i];
+        for (j = 0; j < ARRAY_SIZE(lock_funcs[i].symbols) && lock_funcs[i].symbols[j]; j++) {
+            memset(&probe->rp, 0, sizeof(probe->rp));
+            probe->kind = i;
+            probe->rp.kp.symbol_name = lock_funcs[i].symbols[j];
+            probe->rp.entry_handler = lock_entry;
+            probe->rp.handler = lock_return;
+            probe->rp.data_size = sizeof(struct lock_call);
+            probe->rp.maxactive = 4 * num_possible_cpus();     /* Sleeping locks stay active long */
+            if (!register_kretprobe(&probe->rp)) {
+                probe->registered = true;
+                attached++;
+                break;
+            }
+        }
+        if (!probe->registered)
+            printk(KERN_INFO "Couldn't probe the %s slow path, not profiling it\n", lock_funcs[i].kind);
+    }
+    
+    if (attached)
+        WRITE_ONCE(locks, 1);
+    mutex_unlock(&locks_mutex);
+    return attached ? 0 : -ENOENT;
+}
+
+/* Orders sites by kind then frames, so copies of one site end up next to each other */
+static int cmp_site_key(const void * a, const void * b) {
+    const struct lock_site * x = a, * y = b;
+    
+    if (x->kind != y->kind)
+        return x->kind < y->kind ? -1 : 1;
+    if (x->nr != y->nr)
+        return x->nr < y->nr ? -1 : 1;
+    return memcmp(x->ips, y->ips, x->nr * sizeof(unsigned long));
+}
+
+/* Most wait first */
+static int cmp_site_wait_desc(const void * a, const void * b) {
+    const struct lock_site * x = a, * y = b;
+    
+    if (x->wait_ns == y->wait_ns)
+        return 0;
+    return x->wait_ns > y->wait_ns ? -1 : 1;
+}
+
+/*
+ * Function that writes /proc/perftop_locks, every contended call site
+ * merged over all CPUs with its waits, the most total wait first. The
+ * site is the lock call and LOCK_SITE_DEPTH - 1 of its callers.
+ */
+static int perftop_locks_show(struct seq_file * m, void * v) {
+    struct lock_cpu * lc;
+    struct lock_site * sites, * site;
+    u64 dropped = 0;
+    int count = 0, merged = 0;
+    int cpu, used, i, j;
+    
+    mutex_lock(&locks_mutex);
+    if (!locks) {
+        mutex_unlock(&locks_mutex);
+        seq_printf(m, "Lock profiling is off, write locks=1 to /proc/perftop\n");
+        return 0;
+    }
+    
+    for (i = 0; i < LOCK_KINDS; i++) {
+        if (lock_probes[i].registered)
+            seq_printf(m, "Probing %s: %s, missed %d\n", lock_funcs[i].kind,
+                    lock_probes[i].rp.kp.symbol_name, lock_probes[i].rp.nmissed);
+    }
+    
+    for_each_possible_cpu(cpu)
+        count += smp_load_acquire(&per_cpu_ptr(lock_cpus, cpu)->used);
+    sites = kvmalloc_array(count ? count : 1, sizeof(struct lock_site), GFP_KERNEL);
+    if (!sites) {
+        mutex_unlock(&locks_mutex);
+        return -ENOMEM;
+    }
+    
+    /* Sites added since we counted are left for the next read */
+    i = 0;
+    for_each_possible_cpu(cpu) {
+        lc = per_cpu_ptr(lock_cpus, cpu);
+        used = smp_load_acquire(&lc->used);
+        for (j = 0; j < used && i < count; j++)
+            memcpy(&sites[i++], &lc->pool[j], sizeof(struct lock_site));
+        dropped += READ_ONCE(lc->dropped);
+    }
+    mutex_unlock(&locks_mutex);
+    count = i;
+    
+    sort(sites, count, sizeof(struct lock_site), cmp_site_key, NULL);
+    for (i = 0; i < count; i++) {
+        if (merged && !cmp_site_key(&sites[merged - 1], &sites[i])) {
+            site = &sites[merged - 1];
+            site->contended += sites[i].contended;
+            site->wait_ns += sites[i].wait_ns;
+            hist_merge(&site->hist, &sites[i].hist);
+        }
+        else if (merged++ != i) {
+            sites[merged - 1] = sites[i];
+        }
+    }
+    sort(sites, merged, sizeof(struct lock_site), cmp_site_wait_desc, NULL);
+    
+    if (dropped)
+        seq_printf(m, "Sites that didn't fit: %llu\n", dropped);
+    for (i = 0; i < merged; i++) {
+        site = &sites[i];
+        seq_printf(m, "Lock: %s Contended: %llu Wait: %llu us Avg: %llu p50: %llu p99: %llu max: %llu ns Site:",
+                lock_funcs[site->kind].kind, site->contended, site->wait_ns / NSEC_PER_USEC,
+                div64_u64(site->wait_ns, site->contended ? : 1),
+                hist_percentile(&site->hist, 50), hist_percentile(&site->hist, 99), site->hist.max);
+        for (j = 0; j < site->nr; j++)
+            seq_printf(m, "%s%pS", j ? " <- " : " ", (void *)site->ips[j]);
+        seq_printf(m, "\n");
+    }
+    kvfree(sites);
+    return 0;
+}
+
+static int perftop_locks_open(struct inode * inode, struct file * file) {
+    return single_open(file, perftop_locks_show, NULL);
+}
+
+/* struct that define the callbacks for /proc/perftop_locks */
+static const struct proc_ops perftop_locks_proc_ops = {
+    .proc_open = perftop_locks_open,
+    .proc_read = seq_read,
+    .proc_lseek = seq_lseek,
+    .proc_release = single_release
+};
+
+/* Lock profiling is started later by set_locks */
+static int locks_init(void) {
+    lock_cpus = alloc_percpu(struct lock_cpu);
+    lock_probes = kcalloc(LOCK_KINDS, sizeof(struct lock_probe), GFP_KERNEL);
+    if (!lock_cpus || !lock_probes) {
+        free_percpu(lock_cpus);
+        kfree(lock_probes);
+        return -ENOMEM;
+    }
+    return 0;
+}
+
+static void locks_exit(void) {
+    int cpu;
+    
+    mutex_lock(&locks_mutex);
+    detach_locks();
+    mutex_unlock(&locks_mutex);
+    for_each_possible_cpu(cpu)
+        kvfree(per_cpu_ptr(lock_cpus, cpu)->pool);
+    free_percpu(lock_cpus);
+    kfree(lock_probes);
+}
+
+/* pid's merged_task, a new one if it has none yet. NULL if allocating failed */
+static struct merged_task * get_merged_task(struct merge_table * merged, pid_t pid) {
+    struct merged_task * task;
+    
+    hash_for_each_possible(merged->tasks, task, hash_list, pid) {
+        if (task->pid == pid)
+            return task;
+    }
+    
+    /* Atomic, callers are in an RCU read side section */
+    task = kmalloc(sizeof(struct merged_task), GFP_ATOMIC);
+    if (!task)
+        return NULL;
+    task->pid = pid;
+    task->ttsc = 0;
+    task->slices = 0;
+    task->tsc_var = 0;
+    task->slices_var = 0;
+    task->window_tsc = 0;
+    task->load = 0;
+    memset(task->migrations, 0, sizeof(task->migrations));
+    memset(&task->rq_lat, 0, sizeof(struct lat_hist));
+    hash_add(merged->tasks, &task->hash_list, task->pid);
+    return task;
+}
+
+/*
+ * Add the time so far of the slice running on cpu_data's CPU to its
+ * task, so tasks that rarely switch out don't look idle. Assumes the
+ * tsc is synchronized across CPUs. The slice isn't counted as a switch
+ * until it ends. Like window_sum, the window only gets the part of it
+ * in full seconds. Returns 1 if the task had to be left out.
+ */
+static int merge_running(struct merge_table * merged, struct perftop_cpu * cpu_data, int secs) {
+    struct running_slice running;
+    struct merged_task * task;
+    u64 now = rdtsc();
+    u64 elapsed;
+    u64 partial;                        /* tsc into the current second */
+    
+    snapshot(cpu_data, &running, &cpu_data->running, sizeof(running));
+    if (running.pid < 0 || !running.start || now <= running.start)
+        return 0;
+    
+    task = get_merged_task(merged, running.pid);
+    if (!task)
+        return 1;
+    elapsed = now - running.start;
+    task->ttsc += elapsed * running.weight;
+    if (secs) {
+        partial = div_u64((u64)(jiffies % HZ) * tsc_khz * 1000, HZ);
+        if (elapsed > partial)
+            task->window_tsc += min_t(u64, elapsed - partial, (u64)secs * tsc_khz * 1000) *
+                    running.weight;
+    }
+    return 0;
+}
+
+/*
+ * Add up every CPU's table into merged, one merged_task per pid, with
+ * the tsc each ran in the last secs seconds if secs isn't 0, plus the
+ * slices still running.
+ * The tables are walked without their locks, every entry is copied
+ * with snapshot() before it's used.
+ * Returns how many tasks had to be left out because allocating failed.
+ */
+static int merge_cpus(struct merge_table * merged, int secs) {
+    struct perftop_cpu * cpu_data;
+    struct my_hash_table_struct * position;
+    struct my_hash_table_struct copy;   /* Consistent copy of position */
+    struct merged_task * task;
+    struct rhashtable_iter iter;
+    unsigned long now = window_now();
+    int dropped = 0;
+    int cpu, i;
+    
+    for_each_possible_cpu(cpu) {
+        cpu_data = per_cpu_ptr(perftop_cpus, cpu);
+        
+        rhashtable_walk_enter(&cpu_data->tasks, &iter);
+        rhashtable_walk_start(&iter);
+        while ((position = rhashtable_walk_next(&iter))) {
+            if (IS_ERR(position)) {
+                if (PTR_ERR(position) == -EAGAIN)
+                    continue;   /* Table got resized, some tasks may come twice */
+                break;
+            }
+            snapshot(cpu_data, &copy, position, sizeof(copy));
+            if (copy.dead)
+                continue;   /* Already counted in exited or evicted */
+            if (!copy.slices && !copy.rq_lat.total)
+                continue;   /* Nothing to show yet */
+            
+            task = get_merged_task(merged, copy.pid);
+            if (!task) {
+                dropped++;
+                continue;
+            }
+            task->ttsc += copy.ttsc;
+            task->slices += copy.slices;
+            task->tsc_var = add_sat(task->tsc_var, copy.tsc_var);
+            task->slices_var += copy.slices_var;
+            if (secs)
+                task->window_tsc += window_sum(&copy, now, secs);
+            task->load += window_load(&copy, now);
+            for (i = 0; i < MIGRATE_KINDS; i++)
+                task->migrations[i] += copy.migrations[i];
+            hist_merge(&task->rq_lat, &copy.rq_lat);
+        }
+        dropped += merge_running(merged, cpu_data, secs);
+        rhashtable_walk_stop(&iter);
+        rhashtable_walk_exit(&iter);
+    }
+    return dropped;
+}
+
+/*
+ * Add up one of the group tables of every CPU into merged, the process
+ * tables if cgroups is false. Returns how many groups had to be left
+ * out because allocating failed.
  */
-struct my_rb_tree_struct {
-    unsigned long long ttsc;        /* Stores the total accumlative tsc time */
-    pid_t pid;                      /* Stores the pid associated with the top-10 scheduled task */
-    struct rb_node node;            /* Embedded rb_node struct */
-};
-
-/* Insertion function for rb-tree */
-static void my_rb_insert(struct rb_root * root, struct my_rb_tree_struct * new) {
-    /* Two level of indirection to prevent null deref */
-    struct rb_node ** link = &root->rb_node;
-    struct rb_node * parent = NULL; /* Points to last node visited*/
-    unsigned long long value = new->ttsc;       /* The value we are inserting */
-    struct my_rb_tree_struct * current_struct;  /* Used to store entry struct */
+static int merge_groups(struct group_table * merged, bool cgroups) {
+    struct perftop_cpu * cpu_data;
+    struct group_entry * position, * group;
+    struct group_entry copy;            /* Consistent copy of position */
+    struct hlist_head * table;
+    unsigned int bits;
+    int dropped = 0;
+    int cpu, bkt;
     
-    /* Go down the tree until insertion place is found, link == NULL basically */
-    while (*link) {
-        parent = *link;     /* Put the current pointer pointed by link into parent */
+    for_each_possible_cpu(cpu) {
+        cpu_data = per_cpu_ptr(perftop_cpus, cpu);
+        table = cgroups ? cpu_data->cgroups : cpu_data->tgids;
+        bits = cgroups ? HASH_BITS(cpu_data->cgroups) : HASH_BITS(cpu_data->tgids);
         
-        /* Get encapsulating struct around parent by calling rb_entry */
-        current_struct = rb_entry(parent, struct my_rb_tree_struct, node);
-        
-        /* Belongs in the left sub-tree */
-        if (current_struct->ttsc > value)
-            link = &(*link)->rb_left;
-        else
-            link = &(*link)->rb_right;
+        rcu_read_lock();
+        for (bkt = 0; bkt < (1 << bits); bkt++) {
+            hlist_for_each_entry_rcu(position, &table[bkt], hash_list) {
+                snapshot(cpu_data, &copy, position, sizeof(copy));
+                hash_for_each_possible(merged->groups, group, hash_list, copy.id) {
+                    if (group->id == copy.id)
+                        break;
+                }
+                
+                if (!group) {
+                    /* Atomic, we are in an RCU read side section */
+                    group = kmalloc(sizeof(struct group_entry), GFP_ATOMIC);
+                    if (!group) {
+                        dropped++;
+                        continue;
+                    }
+                    group->id = copy.id;
+                    group->ttsc = 0;
+                    group->slices = 0;
+                    memcpy(group->comm, copy.comm, TASK_COMM_LEN);
+                    hash_add(merged->groups, &group->hash_list, group->id);
+                }
+                group->ttsc += copy.ttsc;
+                group->slices += copy.slices;
+            }
+        }
+        rcu_read_unlock();
     }
-    
-    /* Insert the node at parent */
-    rb_link_node(&new->node, parent, link);
-    
-    /* Rebalance if needed */
-    rb_insert_color(&new->node, root);
+    return dropped;
 }
 
-/*
- * Callback for when func_name is called
- */
-static int entry_pick_next_fair(struct kretprobe_instance * ri, struct pt_regs * regs) {
-    struct my_data * data;
+static int cmp_group_desc(const void * a, const void * b) {
+    const struct group_entry * x = *(const struct group_entry **)a;
+    const struct group_entry * y = *(const struct group_entry **)b;
     
-    if (!current->mm)
-        return 1;   /* Skip kernel threads*/
-    /*
-     * %rdi contain struct rq * rq
-     * %rsi contain struct task_struct * prev
-     * %rdx contain struct rq_flags * rf
-     * https://wiki.osdev.org/System_V_ABI
-     * https://aaronbloomfield.github.io/pdr/book/x86-64bit-ccc-chapter.pdf
-     */
-    data = (struct my_data *)ri->data;  /* Get the data from instance, typecast to my_data */
-    data->prev = regs->si;              /* %rsi is the second parameter that contain prev */
-    spin_lock(&pre_count_lock);
-    pre_count++;
-    spin_unlock(&pre_count_lock);
+    if (x->ttsc != y->ttsc)
+        return x->ttsc < y->ttsc ? 1 : -1;
     return 0;
 }
-NOKPROBE_SYMBOL(entry_pick_next_fair);    /* Don't probe this function */
 
 /*
- * Callback for when func_name is returned
+ * List the k processes or cgroups with the most tsc. There are far
+ * fewer groups than tasks, so they're simply all sorted. A cgroup's id
+ * is the inode number of its directory under /sys/fs/cgroup.
  */
-static int ret_pick_next_fair(struct kretprobe_instance * ri, struct pt_regs * regs) {
-    struct my_data * data;
-    unsigned long next;
-    
-    struct my_hash_table_struct * hash_to_add;   /* temp var used for adding to hashtable */
-    struct my_hash_table_struct * position; /* Used for bucket iteration */
-    pid_t pid;                              /* Storing prev|next's PID */
+static void show_groups(struct seq_file * m, bool cgroups, int k) {
+    struct group_table * merged;
+    struct group_entry * group;
+    struct group_entry ** sorted = NULL;
+    struct hlist_node * tmp;
+    int dropped;
+    int count = 0;
+    int bkt, i;
     
-    struct my_rb_tree_struct * node_to_add;      /* temp var for adding to rb-tree */
-    struct my_rb_tree_struct * my_struct_entry;  /* Holds the unwrapped struct */
+    merged = kmalloc(sizeof(struct group_table), GFP_KERNEL);
+    if (!merged)
+        return;
+    hash_init(merged->groups);
+    dropped = merge_groups(merged, cgroups);
     
-    unsigned long long start_tsc;   /* Obtained from hash table. The last tsc timestamp */
-    unsigned long long current_tsc; /* rdtsc() */
-    unsigned long long elapsed;     /* start_tsc - current_tsc */
+    hash_for_each(merged->groups, bkt, group, hash_list)
+        count++;
+    if (count)
+        sorted = kmalloc_array(count, sizeof(struct group_entry *), GFP_KERNEL);
     
-    next = regs_return_value(regs);     /* Get return value of func_name. In our case the next task_struct **/
-
-    data = (struct my_data *)ri->data;  /* Retriveing my_data from instance */
-    if (data->prev != next && next != UNSIGN_LONG_NULL && data->prev != UNSIGN_LONG_NULL) {
-        /*
-         * Only increment if next != null, prev != null, prev != next.
-         * No race condition will occur, because next, prev are all unique
-         * per instance. If two threads needs to increment context_switch
-         * the spin_lock will force the others to wait. If it doesn't need to
-         * increment context_switch then no need to lock it.
-         */
-        spin_lock(&post_timing_lock);
-        context_switch_counter++;
-        
-        /* Work for prev */
-        pid = ((struct task_struct *)data->prev)->pid;
-        current_tsc = rdtsc();
+    if (sorted) {
+        i = 0;
+        hash_for_each(merged->groups, bkt, group, hash_list)
+            sorted[i++] = group;
+        sort(sorted, count, sizeof(struct group_entry *), cmp_group_desc, NULL);
         
-        hash_for_each_possible(ht_wrapper->myhashtable, position, hash_list, pid) {
-            if (position->pid == pid) {
-                /* pid match, we found the entry, get the start_tsc from this entry */
-                break;
-            }
+        seq_printf(m, "Top %d %s by tsc: \n", k, cgroups ? "cgroups" : "processes");
+        for (i = 0; i < count && i < k; i++) {
+            group = sorted[i];
+            if (cgroups)
+                seq_printf(m, "Cgroup: %*llu Total tsc: %llu Switches: %llu\n",
+                        8, group->id, group->ttsc, group->slices);
+            else
+                seq_printf(m, "TGID: %*llu Total tsc: %llu Switches: %llu Comm: %s\n",
+                        5, group->id, group->ttsc, group->slices, group->comm);
         }
-        
-        /*
-         * position is null = didn't find entry in hash table.
-         * We will initialize one for prev. And add in a new
-         * rb_node into the tree.
-         */
-        if (!position) {
-            hash_to_add = kmalloc(sizeof(struct my_hash_table_struct), GFP_ATOMIC);
-            hash_to_add->pid = pid;
-            hash_to_add->node = NULL;
-            hash_to_add->tsc = current_tsc;
+    }
+    if (dropped)
+        seq_printf(m, "Out of memory, %d %s left out\n", dropped, cgroups ? "cgroups" : "processes");
+    
+    hash_for_each_safe(merged->groups, bkt, tmp, group, hash_list)
+        kfree(group);
+    kfree(merged);
+    kfree(sorted);
+}
+
+/* Move heap[i] down until both children are bigger, heap[0] is the smallest */
+static void heap_sift_down(struct merged_task ** heap, int size, int i) {
+    int smallest, child;
+    
+    for (;;) {
+        smallest = i;
+        child = 2 * i + 1;
+        if (child < size && heap[child]->key < heap[smallest]->key)
+            smallest = child;
+        if (child + 1 < size && heap[child + 1]->key < heap[smallest]->key)
+            smallest = child + 1;
+        if (smallest == i)
+            return;
+        swap(heap[i], heap[smallest]);
+        i = smallest;
+    }
+}
+
+/* Biggest key first, for sorting the selected tasks */
+static int cmp_key_desc(const void * a, const void * b) {
+    const struct merged_task * x = *(struct merged_task * const *)a;
+    const struct merged_task * y = *(struct merged_task * const *)b;
+    
+    if (x->key == y->key)
+        return 0;
+    return x->key > y->key ? -1 : 1;
+}
+
+/*
+ * Pick the k tasks with the biggest key into top, biggest first.
+ * Keeps a min-heap of the best k seen so far, so this is O(n log k)
+ * and nothing is kept ordered between reads. Returns how many were picked.
+ */
+static int select_top_k(struct merge_table * merged, struct merged_task ** top, int k, int key,
+        int secs) {
+    struct merged_task * task;
+    int size = 0;
+    int bkt;
+    
+    hash_for_each(merged->tasks, bkt, task, hash_list) {
+        switch (key) {
+            case SORT_SWITCHES:
+            task->key = task->slices;
+            break;
             
-            hash_add(ht_wrapper->myhashtable, &hash_to_add->hash_list, pid);
-            position = hash_to_add;
+            case SORT_AVG:
+            task->key = task->slices ? div64_u64(task->ttsc, task->slices) : 0;
+            break;
+            
+            case SORT_LOAD:
+            task->key = task->load;
+            break;
+            
+            default:
+            task->key = secs ? task->window_tsc : task->ttsc;
         }
         
-        start_tsc = position->tsc;
-        elapsed = current_tsc - start_tsc;
-        node_to_add = kmalloc(sizeof(struct my_rb_tree_struct), GFP_ATOMIC);
-        node_to_add->pid = pid;     /* Can be updated outside */
-        
-        /*
-         * If the hash entry already have a old node, must add to it by retrieving
-         * the old entry ttsc. Then erase the old entry & free it.
-         *
-         * If is a brand new hash entry, just set time to be 0
-         * for node_to_add struct.
-         */
-        if (position->node) {
-            my_struct_entry = rb_entry(position->node, struct my_rb_tree_struct, node);
-            node_to_add->ttsc = my_struct_entry->ttsc + elapsed;
+        if (size < k) {
+            /* Heap not full yet, add at the bottom and let it sift up */
+            int i = size++;
             
-            rb_erase(&my_struct_entry->node, &mytree);
-            kfree(my_struct_entry);
+            top[i] = task;
+            while (i && top[(i - 1) / 2]->key > top[i]->key) {
+                swap(top[i], top[(i - 1) / 2]);
+                i = (i - 1) / 2;
+            }
         }
-        else {
-            node_to_add->ttsc = 0;
+        else if (task->key > top[0]->key) {
+            /* Better than the worst we have, replace it */
+            top[0] = task;
+            heap_sift_down(top, size, 0);
         }
-        position->node = &node_to_add->node;     /* Update hash entry with new node */
-        my_rb_insert(&mytree, node_to_add);      /* Add to rb-tree */
+    }
+    
+    sort(top, size, sizeof(struct merged_task *), cmp_key_desc, NULL);
+    return size;
+}
+
+/*
+ * Sampler summary for /proc/perftop. The overhead is the share of each
+ * CPU's time spent in sample_stack at the current rate.
+ */
+static void show_sampler(struct seq_file * m) {
+    struct sampler_cpu * sc;
+    u64 samples = 0, idle = 0, dropped = 0, cycles = 0;
+    u64 per_sample, overhead;
+    int hz = READ_ONCE(sample_hz);
+    int cpu;
+    
+    if (!hz) {
+        seq_printf(m, "Stack sampler: off\n");
+        return;
+    }
+    
+    for_each_possible_cpu(cpu) {
+        sc = per_cpu_ptr(sampler_cpus, cpu);
+        samples += READ_ONCE(sc->samples);
+        idle += READ_ONCE(sc->idle);
+        dropped += READ_ONCE(sc->dropped);
+        cycles += READ_ONCE(sc->cycles);
+    }
+    
+    /* cycles per sample * hz / (tsc_khz * 1000), in hundredths of a percent */
+    per_sample = samples ? div64_u64(cycles, samples) : 0;
+    overhead = div64_u64(per_sample * hz * 10000, (u64)tsc_khz * 1000 ? : 1);
+    
+    seq_printf(m, "Stack sampler: %d Hz, %llu samples, %llu idle, %llu dropped, "
+            "%llu cycles per sample (%llu.%02llu%% per CPU)\n",
+            hz, samples, idle, dropped, per_sample, overhead / 100, overhead % 100);
+}
+
+/* Off-CPU profiling summary for /proc/perftop, the stacks are in /proc/perftop_offcpu */
+static void show_offcpu(struct seq_file * m) {
+    struct offcpu_cpu * oc;
+    u64 dropped = 0;
+    int stacks = 0;
+    int cpu;
+    
+    if (!READ_ONCE(offcpu)) {
+        seq_printf(m, "Off-CPU profiling: off\n");
+        return;
+    }
+    
+    for_each_possible_cpu(cpu) {
+        oc = per_cpu_ptr(offcpu_cpus, cpu);
+        stacks += smp_load_acquire(&oc->used);
+        dropped += READ_ONCE(oc->dropped);
+    }
+    seq_printf(m, "Off-CPU profiling: %d blocking stacks, %llu dropped\n", stacks, dropped);
+}
+
+/*
+ * Self timing of the switch handlers over all CPUs, in tsc cycles and
+ * in ns. The histograms are copied without snapshot(), the handlers
+ * add to them outside seq, so the percentiles may be an event off.
+ */
+static void show_handler_timing(struct seq_file * m, u64 avg) {
+    struct lat_hist hist;
+    u64 p50, p99;
+    u64 khz = tsc_khz ? : 1;
+    int cpu;
+    
+    memset(&hist, 0, sizeof(struct lat_hist));
+    for_each_possible_cpu(cpu)
+        hist_merge(&hist, &per_cpu_ptr(perftop_cpus, cpu)->handler_hist);
+    p50 = hist_percentile(&hist, 50);
+    p99 = hist_percentile(&hist, 99);
+    
+    seq_printf(m, "Handler overhead: %llu cycles per event, p50: %llu p99: %llu max: %llu cycles\n",
+            avg, p50, p99, hist.max);
+    seq_printf(m, "Handler overhead: %llu ns per event, p50: %llu p99: %llu max: %llu ns\n",
+            div64_u64(avg * 1000000, khz), div64_u64(p50 * 1000000, khz),
+            div64_u64(p99 * 1000000, khz), div64_u64(hist.max * 1000000, khz));
+}
+
+/* Per-CPU run queue latency */
+static void show_rq_latency(struct seq_file * m) {
+    struct perftop_cpu * cpu_data;
+    struct lat_hist hist;
+    int cpu;
+    
+    if (!wakeup_attached)
+        return;
+    
+    seq_printf(m, "Run queue latency per CPU (us): \n");
+    for_each_possible_cpu(cpu) {
+        cpu_data = per_cpu_ptr(perftop_cpus, cpu);
+        snapshot(cpu_data, &hist, &cpu_data->rq_lat, sizeof(hist));
         
-        /* Work for next */
-        pid = ((struct task_struct *)(next))->pid;
+        if (!hist.total)
+            continue;
+        seq_printf(m, "CPU: %*d Wakeups: %llu p50: %llu p99: %llu max: %llu\n",
+                3, cpu, hist.total, hist_percentile(&hist, 50) / NSEC_PER_USEC,
+                hist_percentile(&hist, 99) / NSEC_PER_USEC, hist.max / NSEC_PER_USEC);
+    }
+}
+
+/* Half width of a 95% confidence interval for an estimate with this variance */
+static u64 conf_bound(u64 var) {
+    return int_sqrt64(var) * 196 / 100;
+}
+
+/*
+ * A task's migrations by kind, and how often a slice of its started
+ * on a different CPU than the last one, in hundredths of a percent.
+ */
+static void show_task_migrations(struct seq_file * m, struct merged_task * task) {
+    u64 total = 0, rate;
+    int i;
+    
+    for (i = 0; i < MIGRATE_KINDS; i++)
+        total += task->migrations[i];
+    if (!total)
+        return;
+    
+    rate = task->slices ? div64_u64(total * 10000, task->slices) : 0;
+    seq_printf(m, " Migrations: %llu (%llu.%02llu%% of slices,", total, rate / 100, rate % 100);
+    for (i = 0; i < MIGRATE_KINDS; i++)
+        seq_printf(m, " %s: %llu", migrate_names[i], task->migrations[i]);
+    seq_printf(m, ")");
+}
+
+/* Migrations into each CPU since load, by kind, with the rate per second */
+static void show_migrations(struct seq_file * m) {
+    struct perftop_cpu * cpu_data;
+    unsigned long long migrations[MIGRATE_KINDS];
+    unsigned long secs = (jiffies - loaded_at) / HZ ? : 1;
+    u64 total;
+    int cpu, i;
+    
+    if (!migrate_attached)
+        return;
+    
+    seq_printf(m, "Migrations into each CPU since load (per second): \n");
+    for_each_possible_cpu(cpu) {
+        cpu_data = per_cpu_ptr(perftop_cpus, cpu);
+        snapshot(cpu_data, migrations, cpu_data->migrations, sizeof(migrations));
         
-        hash_for_each_possible(ht_wrapper->myhashtable, position, hash_list, pid) {
-            if (position->pid == pid)
-                break; /* Break if entry found */
-        }
+        total = 0;
+        for (i = 0; i < MIGRATE_KINDS; i++)
+            total += migrations[i];
+        if (!total)
+            continue;
+        seq_printf(m, "CPU: %*d Migrations: %llu (%llu/s)", 3, cpu, total, div64_u64(total, secs));
+        for (i = 0; i < MIGRATE_KINDS; i++)
+            seq_printf(m, " %s: %llu", migrate_names[i], migrations[i]);
+        seq_printf(m, "\n");
+    }
+}
+
+/* Function that actually writes to the proc file  */
+static int perftop_proc_show(struct seq_file * m, void * v) {
+    struct perftop_cpu * cpu_data;
+    struct merge_table * merged;
+    struct merged_task * task;
+    struct merged_task ** top;          /* The tasks we list, best first */
+    struct hlist_node * tmp;
+    int k = READ_ONCE(top_k);
+    int key = READ_ONCE(sort_key);
+    int secs = READ_ONCE(window_secs);
+    u64 share;
+    int pre_count = 0, post_count = 0, context_switch_counter = 0;
+    unsigned long long switch_events = 0, handler_cycles = 0, alloc_failures = 0;
+    unsigned long long groups_evicted = 0;
+    unsigned long long events;          /* Handler invocations the cycles were spent on */
+    struct retired_tasks exited = {0}, evicted = {0};
+    struct retired_tasks retired;       /* One CPU's exited or evicted */
+    int dropped;
+    int cpu, bkt;
+    int count, i;
+    
+    merged = kmalloc(sizeof(struct merge_table), GFP_KERNEL);
+    top = kmalloc_array(k, sizeof(struct merged_task *), GFP_KERNEL);
+    if (!merged || !top) {
+        kfree(merged);
+        kfree(top);
+        return -ENOMEM;
+    }
+    hash_init(merged->tasks);
+    
+    for_each_possible_cpu(cpu) {
+        cpu_data = per_cpu_ptr(perftop_cpus, cpu);
+        pre_count += READ_ONCE(cpu_data->pre_count);
+        post_count += READ_ONCE(cpu_data->post_count);
+        context_switch_counter += READ_ONCE(cpu_data->context_switch_counter);
+        switch_events += READ_ONCE(cpu_data->switch_events);
+        handler_cycles += READ_ONCE(cpu_data->handler_cycles);
+        alloc_failures += READ_ONCE(cpu_data->alloc_failures);
+        groups_evicted += READ_ONCE(cpu_data->groups_evicted);
         
-        if (!position) {
-            /* Next doesn't have entry yet either */
-            hash_to_add = kmalloc(sizeof(struct my_hash_table_struct), GFP_ATOMIC);
-            hash_to_add->node = NULL;
-            hash_to_add->tsc = current_tsc;
-            hash_to_add->pid = pid;
-            
-            hash_add(ht_wrapper->myhashtable, &hash_to_add->hash_list, pid);
-        }
-        else {
-            /* If it has then just update tsc with current_tsc */
-            position->tsc = current_tsc;
+        snapshot(cpu_data, &retired, &cpu_data->exited, sizeof(retired));
+        exited.tasks += retired.tasks;
+        exited.ttsc += retired.ttsc;
+        exited.slices += retired.slices;
+        snapshot(cpu_data, &retired, &cpu_data->evicted, sizeof(retired));
+        evicted.tasks += retired.tasks;
+        evicted.ttsc += retired.ttsc;
+        evicted.slices += retired.slices;
+    }
+    
+    dropped = merge_cpus(merged, secs);
+    count = select_top_k(merged, top, k, key, secs);
+    
+    if (use_tracepoint) {
+        seq_printf(m, "Backend: sched_switch tracepoint\n");
+        seq_printf(m, "Switch events: %llu Context switch: %d\n",
+                switch_events, context_switch_counter);
+        events = switch_events;
+    }
+    else {
+        seq_printf(m, "Backend: kretprobe on %s, missed %d\n",
+                func_name, my_kretprobe.nmissed);
+        seq_printf(m, "Pre count: %d Post count: %d Context switch: %d\n",
+                pre_count, post_count, context_switch_counter);
+        events = post_count;
+    }
+    show_handler_timing(m, events ? handler_cycles / events : 0);
+    if (dropped)
+        seq_printf(m, "Out of memory, %d tasks left out\n", dropped);
+    if (alloc_failures)
+        seq_printf(m, "Task and group entries the spares ran out for: %llu\n", alloc_failures);
+    seq_printf(m, "Exited tasks: %llu Total tsc: %llu Switches: %llu\n",
+            exited.tasks, exited.ttsc, exited.slices);
+    seq_printf(m, "Evicted tasks: %llu Total tsc: %llu Switches: %llu (%d of %d tracked)\n",
+            evicted.tasks, evicted.ttsc, evicted.slices, atomic_read(&tracked_tasks), max_tasks);
+    seq_printf(m, "Evicted processes and cgroups: %llu (%d of %d tracked)\n",
+            groups_evicted, atomic_read(&tracked_groups), max_groups);
+    show_sampler(m);
+    show_offcpu(m);
+    if (READ_ONCE(sample_every) > 1)
+        seq_printf(m, "Sampling 1 in %d switches, totals are estimates with 95%% bounds\n",
+                READ_ONCE(sample_every));
+    
+    if (secs)
+        seq_printf(m, "Top %d task by %s over the last %ds: \n", k, sort_names[key], secs);
+    else
+        seq_printf(m, "Top %d task by %s: \n", k, sort_names[key]);
+    for (i = 0; i < count; i++) {
+        task = top[i];
+        seq_printf(m, "PID: %*d Total tsc: %lld Switches: %llu Avg slice: %llu",
+            5, task->pid, task->ttsc, task->slices,
+            task->slices ? div64_u64(task->ttsc, task->slices) : 0);
+        if (task->slices_var)
+            seq_printf(m, " (tsc +/-%llu switches +/-%llu)",
+                    conf_bound(task->tsc_var) << VAR_SHIFT, conf_bound(task->slices_var));
+        if (secs) {
+            share = cpu_share(task->window_tsc, secs);
+            seq_printf(m, " %ds tsc: %llu (%llu.%02llu%%)", secs, task->window_tsc,
+                    share / 100, share % 100);
         }
-        spin_unlock(&post_timing_lock);
+        share = cpu_share(task->load, 1);
+        seq_printf(m, " Load: %llu.%02llu%%", share / 100, share % 100);
+        show_task_migrations(m, task);
+        if (task->rq_lat.total)
+            seq_printf(m, " RQ latency p50: %llu p99: %llu max: %llu us",
+                    hist_percentile(&task->rq_lat, 50) / NSEC_PER_USEC,
+                    hist_percentile(&task->rq_lat, 99) / NSEC_PER_USEC,
+                    task->rq_lat.max / NSEC_PER_USEC);
+        seq_printf(m, "\n");
     }
-    spin_lock(&post_count_lock);
-    post_count++;
-    spin_unlock(&post_count_lock);
+    show_groups(m, false, k);
+    show_groups(m, true, k);
+    show_rq_latency(m);
+    show_migrations(m);
+    
+    hash_for_each_safe(merged->tasks, bkt, tmp, task, hash_list)
+        kfree(task);
+    kfree(merged);
+    kfree(top);
     return 0;
 }
-NOKPROBE_SYMBOL(ret_pick_next_fair);    /* Don't probe this function */
 
-static struct kretprobe my_kretprobe = {
-    .handler = ret_pick_next_fair,          /* The callback used when the probing function is returned */
-    .entry_handler = entry_pick_next_fair,  /* The callback used when the probing function is entered */
-    .data_size = sizeof(struct my_data),    /* No screwing around with the size, provide it! */
-    .maxactive = 8     /* How many concurrent instances of probes. At least 8 to not miss any */
-};
+/*
+ * Apply one name=value setting written to /proc/perftop.
+ * Returns 0 or -EINVAL if the name or value isn't valid.
+ */
+static int perftop_set(const char * name, const char * value) {
+    int n;
+    
+    if (!strcmp(name, "k")) {
+        if (kstrtoint(value, 10, &n) || n < 1 || n > MAX_TOP_K)
+            return -EINVAL;
+        WRITE_ONCE(top_k, n);
+        return 0;
+    }
+    
+    if (!strcmp(name, "sample_hz")) {
+        if (kstrtoint(value, 10, &n))
+            return -EINVAL;
+        return set_sample_hz(n);
+    }
+    
+    if (!strcmp(name, "sample_every")) {
+        if (kstrtoint(value, 10, &n) || n < 1 || n > MAX_SAMPLE_EVERY)
+            return -EINVAL;
+        WRITE_ONCE(sample_every, n);
+        return 0;
+    }
+    
+    if (!strcmp(name, "window")) {
+        for (n = 0; n < ARRAY_SIZE(window_names); n++) {
+            if (!strcmp(value, window_names[n])) {
+                WRITE_ONCE(window_secs, window_lengths[n]);
+                return 0;
+            }
+        }
+        return -EINVAL;
+    }
+    
+    if (!strcmp(name, "funcs"))
+        return set_funcs(value);
+    
+    if (!strcmp(name, "wakegraph")) {
+        if (kstrtoint(value, 10, &n))
+            return -EINVAL;
+        return set_wakegraph(n);
+    }
+    
+    if (!strcmp(name, "locks")) {
+        if (kstrtoint(value, 10, &n))
+            return -EINVAL;
+        return set_locks(n);
+    }
+    
+    if (!strcmp(name, "offcpu")) {
+        if (kstrtoint(value, 10, &n))
+            return -EINVAL;
+        return set_offcpu(n);
+    }
+    
+    if (!strcmp(name, "sort")) {
+        for (n = 0; n < SORT_KEYS; n++) {
+            if (!strcmp(value, sort_names[n])) {
+                WRITE_ONCE(sort_key, n);
+                return 0;
+            }
+        }
+        return -EINVAL;
+    }
+    return -EINVAL;
+}
 
-/* Function that actually writes to the proc file  */
-static int perftop_proc_show(struct seq_file * m, void * v) {
-    struct my_rb_tree_struct * my_struct_entry;
-    struct rb_node * position;
-    int i = 0;      /* Used to iterate 10 times */
-    
-    seq_printf(m, "Pre count: %d Post count: %d Context switch: %d\n",
-            pre_count, post_count, context_switch_counter);
-    
-    seq_printf(m, "Top 10 task: \n");
-    spin_lock(&post_timing_lock);
-    position = rb_last(&mytree);
-    while (i < 10 && position) {
-        my_struct_entry = rb_entry(position, struct my_rb_tree_struct, node);
-        seq_printf(m, "PID: %*d Total tsc: %lld\n",
-            5, my_struct_entry->pid, my_struct_entry->ttsc);
-        position = rb_prev(position);
-        i += 1;
-    }
-    spin_unlock(&post_timing_lock);
-    return 0;
+/*
+ * Write callback, takes space separated name=value settings, e.g.
+ * echo "k=20 sort=avg sample_hz=99 sample_every=10 window=10s offcpu=1 wakegraph=1 locks=1" > /proc/perftop
+ * funcs= takes a comma separated list, e.g. funcs=vfs_read,vfs_write
+ */
+static ssize_t perftop_proc_write(struct file * file, const char __user * ubuf,
+        size_t count, loff_t * ppos) {
+    char buf[320];      /* Room for a whole funcs= list */
+    char * cursor = buf;
+    char * token, * value;
+    int ret;
+    
+    if (count >= sizeof(buf))
+        return -EINVAL;
+    if (copy_from_user(buf, ubuf, count))
+        return -EFAULT;
+    buf[count] = '\0';
+    
+    while ((token = strsep(&cursor, " \t\n"))) {
+        if (!*token)
+            continue;
+        
+        value = strchr(token, '=');
+        if (!value)
+            return -EINVAL;
+        *value++ = '\0';
+        
+        if ((ret = perftop_set(token, value)))
+            return ret;
+    }
+    return count;
 }
 
 /*
@@ -266,68 +3332,381 @@ static int perftop_proc_open(struct inode * inode, struct file * file) {
 static const struct proc_ops perftop_proc_ops = {
     .proc_open = perftop_proc_open,
     .proc_read = seq_read,
+    .proc_write = perftop_proc_write,
     .proc_lseek = seq_lseek,
     .proc_release = single_release
 };
 
+/*
+ * Prefer the sched_switch tracepoint, it sees every switch and costs
+ * less per event. The kretprobe is the fallback, or can be asked for
+ * with backend=kretprobe.
+ */
+static int attach_backend(void) {
+    int ret;
+    
+    if (strcmp(backend, "kretprobe")) {
+        sched_switch_tp = find_tracepoint("sched_switch");
+        if (!sched_switch_tp)
+            printk(KERN_ERR "sched_switch tracepoint not found, using kretprobe\n");
+        else if ((ret = tracepoint_probe_register(sched_switch_tp, probe_sched_switch, NULL)))
+            printk(KERN_ERR "tracepoint_probe_register failed, returned %d, using kretprobe\n", ret);
+        else {
+            use_tracepoint = 1;
+            printk(KERN_INFO "Attached to sched_switch tracepoint\n");
+            return 0;
+        }
+    }
+    
+    my_kretprobe.kp.symbol_name = func_name;    /* Register the function */
+    ret = register_kretprobe(&my_kretprobe);
+    if (ret < 0) {
+        printk(KERN_ERR "register_kretprobe failed, returned %d\n", ret);
+        return ret;
+    }
+    printk(KERN_INFO "Planted return probe at %s: %p\n",
+            my_kretprobe.kp.symbol_name, my_kretprobe.kp.addr);
+    return 0;
+}
+
+/*
+ * Wakeup tracepoints for the run queue latency. Optional, without them
+ * perftop just doesn't show latencies.
+ */
+static void attach_wakeups(void) {
+    task_stamps = vzalloc(sizeof(struct task_stamp) << STAMP_BITS);
+    sched_wakeup_tp = find_tracepoint("sched_wakeup");
+    sched_wakeup_new_tp = find_tracepoint("sched_wakeup_new");
+    
+    if (!task_stamps || !sched_wakeup_tp || !sched_wakeup_new_tp)
+        goto fail;
+    if (tracepoint_probe_register(sched_wakeup_tp, probe_sched_wakeup, NULL))
+        goto fail;
+    if (tracepoint_probe_register(sched_wakeup_new_tp, probe_sched_wakeup, NULL)) {
+        tracepoint_probe_unregister(sched_wakeup_tp, probe_sched_wakeup, NULL);
+        goto fail;
+    }
+    wakeup_attached = 1;
+    return;
+
+fail:
+    printk(KERN_ERR "Couldn't attach to the wakeup tracepoints, no run queue latency\n");
+    tracepoint_synchronize_unregister();
+    vfree(task_stamps);
+    task_stamps = NULL;
+}
+
+/* Called once the switch backend is detached, so no one reads task_stamps anymore */
+static void detach_wakeups(void) {
+    if (wakeup_attached) {
+        tracepoint_probe_unregister(sched_wakeup_tp, probe_sched_wakeup, NULL);
+        tracepoint_probe_unregister(sched_wakeup_new_tp, probe_sched_wakeup, NULL);
+        tracepoint_synchronize_unregister();
+    }
+    vfree(task_stamps);
+}
+
+/* Migration tracepoint, optional like the wakeups */
+static void attach_migrations(void) {
+    migrate_stamps = vzalloc(sizeof(struct migrate_stamp) << STAMP_BITS);
+    sched_migrate_task_tp = find_tracepoint("sched_migrate_task");
+    
+    if (!migrate_stamps || !sched_migrate_task_tp ||
+            tracepoint_probe_register(sched_migrate_task_tp, probe_sched_migrate_task, NULL)) {
+        printk(KERN_ERR "Couldn't attach to sched_migrate_task, migrations aren't counted\n");
+        vfree(migrate_stamps);
+        migrate_stamps = NULL;
+        return;
+    }
+    migrate_attached = 1;
+}
+
+/* Called once the switch backend is detached, so no one reads migrate_stamps anymore */
+static void detach_migrations(void) {
+    if (migrate_attached) {
+        tracepoint_probe_unregister(sched_migrate_task_tp, probe_sched_migrate_task, NULL);
+        tracepoint_synchronize_unregister();
+    }
+    vfree(migrate_stamps);
+}
+
+static void attach_exit(void) {
+    sched_process_exit_tp = find_tracepoint("sched_process_exit");
+    if (!sched_process_exit_tp ||
+            tracepoint_probe_register(sched_process_exit_tp, probe_sched_process_exit, NULL)) {
+        printk(KERN_ERR "Couldn't attach to sched_process_exit, exited tasks are only evicted\n");
+        return;
+    }
+    exit_attached = 1;
+    
+#if defined(CONFIG_CGROUPS) && LINUX_VERSION_CODE >= KERNEL_VERSION(5, 5, 0)
+    cgroup_rmdir_tp = find_tracepoint("cgroup_rmdir");
+    if (!cgroup_rmdir_tp ||
+            tracepoint_probe_register(cgroup_rmdir_tp, probe_cgroup_rmdir, NULL)) {
+        printk(KERN_ERR "Couldn't attach to cgroup_rmdir, removed cgroups are only evicted\n");
+        return;
+    }
+    rmdir_attached = 1;
+#endif
+}
+
+static void detach_exit(void) {
+#if defined(CONFIG_CGROUPS) && LINUX_VERSION_CODE >= KERNEL_VERSION(5, 5, 0)
+    if (rmdir_attached)
+        tracepoint_probe_unregister(cgroup_rmdir_tp, probe_cgroup_rmdir, NULL);
+#endif
+    if (exit_attached) {
+        tracepoint_probe_unregister(sched_process_exit_tp, probe_sched_process_exit, NULL);
+        tracepoint_synchronize_unregister();
+    }
+}
+
+static void detach_backend(void) {
+    if (use_tracepoint) {
+        tracepoint_probe_unregister(sched_switch_tp, probe_sched_switch, NULL);
+        tracepoint_synchronize_unregister();    /* No probe may still be running below */
+        printk(KERN_INFO "sched_switch tracepoint detached\n");
+    }
+    else {
+        unregister_kretprobe(&my_kretprobe);
+        printk(KERN_INFO "kretprobe at %p unregistered\n", my_kretprobe.kp.addr);
+        
+        printk("Missed probing %d instances of %s\n",
+                my_kretprobe.nmissed, my_kretprobe.kp.symbol_name);
+    }
+}
+
+/* rhashtable_free_and_destroy callback */
+static void free_hashed_entry(void * ptr, void * arg) {
+    kmem_cache_free(task_cache, ptr);
+}
+
 static int __init perftop_init(void) {
+    struct perftop_cpu * cpu_data;
+    int tables_ready;           /* CPUs below this have their tasks table */
+    int offcpu_at_load = offcpu;    /* Started once the pools exist */
+    int wakegraph_at_load = wakegraph;
+    int locks_at_load = locks;
     int ret;
-    /* Initialize the global hashtable */
-    ht_wrapper = kmalloc(sizeof(struct hash_table_wrapper), GFP_KERNEL);
+    int cpu;
+    
+    if (max_tasks < 1 || max_groups < 1 || sample_every < 1 || sample_every > MAX_SAMPLE_EVERY)
+        return -EINVAL;
+    offcpu = 0;
+    wakegraph = 0;
+    locks = 0;
+    load_decay_init();
+    
+    task_cache = KMEM_CACHE(my_hash_table_struct, SLAB_HWCACHE_ALIGN);
+    group_cache = KMEM_CACHE(group_entry, SLAB_HWCACHE_ALIGN);
+    if (!task_cache || !group_cache) {
+        ret = -ENOMEM;
+        goto destroy_cache;
+    }
+    
+    /* Initialize every CPU's counters and tables */
+    perftop_cpus = alloc_percpu(struct perftop_cpu);
+    if (!perftop_cpus) {
+        ret = -ENOMEM;
+        goto destroy_cache;
+    }
+    
+    for_each_possible_cpu(cpu) {
+        cpu_data = per_cpu_ptr(perftop_cpus, cpu);
+        raw_spin_lock_init(&cpu_data->lock);
+        seqcount_raw_spinlock_init(&cpu_data->seq, &cpu_data->lock);
+        if ((ret = rhashtable_init(&cpu_data->tasks, &task_params))) {
+            tables_ready = cpu;
+            goto destroy_tables;
+        }
+        cpu_data->kick_work = IRQ_WORK_INIT_HARD(kick_tasks_work);
+        INIT_WORK(&cpu_data->tasks_work, update_tasks);
+        refill_spares(cpu_data);
+        INIT_LIST_HEAD(&cpu_data->lru);
+        hash_init(cpu_data->tgids);
+        hash_init(cpu_data->cgroups);
+        INIT_LIST_HEAD(&cpu_data->group_lru);
+        prandom_seed_state(&cpu_data->rnd, get_random_u64());
+        cpu_data->running.pid = -1;
+    }
+    tables_ready = nr_cpu_ids;
+    
+    if ((ret = sampler_init()))
+        goto destroy_tables;
+    
+    if ((ret = offcpu_init())) {
+        sampler_exit();
+        goto destroy_tables;
+    }
+    
+    if ((ret = locks_init())) {
+        offcpu_exit();
+        sampler_exit();
+        goto destroy_tables;
+    }
+    
+    if ((ret = misc_register(&ring_device))) {
+        printk(KERN_ERR "misc_register failed, returned %d\n", ret);
+        locks_exit();
+        offcpu_exit();
+        sampler_exit();
+        goto destroy_tables;
+    }
     
     printk(KERN_INFO "My module entered\n");
     
     /* Creates the /proc/perftop file.
-     * 444 file permission, everyone can only read /proc/perftop
+     * 644 file permission, everyone can read /proc/perftop, root can change settings
      * NULL for storing perftop under /proc
      * Finally the struct that describes all the callbacks
      */
-    proc_create("perftop", 0, NULL, &perftop_proc_ops);
+    proc_create("perftop", 0644, NULL, &perftop_proc_ops);
+    proc_create("perftop_stacks", 0444, NULL, &perftop_stacks_proc_ops);
+    proc_create("perftop_funcs", 0444, NULL, &perftop_funcs_proc_ops);
+    proc_create("perftop_offcpu", 0444, NULL, &perftop_offcpu_proc_ops);
+    proc_create("perftop_wakeups", 0444, NULL, &perftop_wakeups_proc_ops);
+    proc_create("perftop_locks", 0444, NULL, &perftop_locks_proc_ops);
     
-    my_kretprobe.kp.symbol_name = func_name;    /* Register the function */
-    ret = register_kretprobe(&my_kretprobe);
-    if (ret < 0) {
-        printk(KERN_ERR "register_kretprobe failed, returned %d\n", ret);
-        return -1;
+    /* Stamps first, so the switch backend finds them from its first event */
+    loaded_at = jiffies;
+    attach_wakeups();
+    attach_migrations();
+    attach_exit();
+    if ((ret = attach_backend())) {
+        detach_exit();
+        detach_migrations();
+        detach_wakeups();
+        goto remove_proc;
     }
-    printk(KERN_INFO "Planted return probe at %s: %p\n",
-            my_kretprobe.kp.symbol_name, my_kretprobe.kp.addr);
+    on_each_cpu(start_running_cpu, NULL, 1);
+    
+    /* sample_hz given at load */
+    if (sample_hz && (ret = set_sample_hz(sample_hz)))
+        printk(KERN_ERR "Starting the stack sampler failed, returned %d\n", ret);
+    
+    /* funcs given at load */
+    if (funcs[0] && (ret = set_funcs(funcs)))
+        printk(KERN_ERR "Profiling funcs failed, returned %d\n", ret);
+    
+    /* wakegraph given at load */
+    if (wakegraph_at_load && (ret = set_wakegraph(wakegraph_at_load)))
+        printk(KERN_ERR "Starting the wakeup graph failed, returned %d\n", ret);
+    
+    /* locks given at load */
+    if (locks_at_load && (ret = set_locks(locks_at_load)))
+        printk(KERN_ERR "Starting lock profiling failed, returned %d\n", ret);
+    
+    /* offcpu given at load */
+    if (offcpu_at_load && (ret = set_offcpu(offcpu_at_load)))
+        printk(KERN_ERR "Starting off-CPU profiling failed, returned %d\n", ret);
     return 0;
+
+remove_proc:
+    remove_proc_entry("perftop_locks", NULL);
+    remove_proc_entry("perftop_wakeups", NULL);
+    remove_proc_entry("perftop_offcpu", NULL);
+    remove_proc_entry("perftop_funcs", NULL);
+    remove_proc_entry("perftop_stacks", NULL);
+    remove_proc_entry("perftop", NULL);
+    misc_deregister(&ring_device);
+    locks_exit();
+    offcpu_exit();
+    sampler_exit();
+destroy_tables:
+    /* The switch backend never ran, so the tables are empty */
+    for_each_possible_cpu(cpu) {
+        if (cpu >= tables_ready)
+            break;
+        rhashtable_destroy(&per_cpu_ptr(perftop_cpus, cpu)->tasks);
+        free_spares(per_cpu_ptr(perftop_cpus, cpu));
+    }
+    free_percpu(perftop_cpus);
+destroy_cache:
+    kmem_cache_destroy(group_cache);
+    kmem_cache_destroy(task_cache);
+    return ret;
 }
 
 static void __exit perftop_exit(void) {
-    struct my_hash_table_struct * position;
-    struct rb_node * node_position, * temp;
-    struct my_rb_tree_struct * node_entry;
+    struct perftop_cpu * cpu_data;
+    struct my_hash_table_struct * position, * next;
+    struct group_entry * group;
+    struct hlist_node * tmp;
     int bkt;
+    int cpu;
     
     printk(KERN_INFO "My module exited\n");
     
     /* Null to signal /proc dir */
+    remove_proc_entry("perftop_locks", NULL);
+    remove_proc_entry("perftop_wakeups", NULL);
+    remove_proc_entry("perftop_offcpu", NULL);
+    remove_proc_entry("perftop_funcs", NULL);
+    remove_proc_entry("perftop_stacks", NULL);
     remove_proc_entry("perftop", NULL);
     
-    unregister_kretprobe(&my_kretprobe);
-    printk(KERN_INFO "kretprobe at %p unregistered\n", my_kretprobe.kp.addr);
+    mutex_lock(&funcs_mutex);
+    detach_funcs();
+    mutex_unlock(&funcs_mutex);
+    locks_exit();
+    detach_backend();
+    detach_exit();
+    detach_migrations();
+    detach_wakeups();
+    sampler_exit();
+    offcpu_exit();
     
-    printk("Missed probing %d instances of %s\n",
-            my_kretprobe.nmissed, my_kretprobe.kp.symbol_name);
-    
-    hash_for_each(ht_wrapper->myhashtable, bkt, position, hash_list) {
-        hash_del(&position->hash_list);
-        kfree(position);
-    }
-    kfree(ht_wrapper);
+    /* Mappings hold a reference on us, so nobody can still have the rings */
+    misc_deregister(&ring_device);
+    vfree(ring_area);
     
-    node_position = rb_first(&mytree);
-    while (node_position) {
-        node_entry = rb_entry(node_position, struct my_rb_tree_struct, node);
-        temp = rb_next(node_position);
-        rb_erase(node_position, &mytree);
-        kfree(node_entry);
-        node_position = temp;
+    for_each_possible_cpu(cpu) {
+        cpu_data = per_cpu_ptr(perftop_cpus, cpu);
+        
+        /* Nothing queues either anymore, apply what is left ourselves */
+        irq_work_sync(&cpu_data->kick_work);
+        cancel_work_sync(&cpu_data->tasks_work);
+        update_tasks(&cpu_data->tasks_work);
+        for (position = cpu_data->pending; position; position = next) {
+            next = position->next_pending;
+            kmem_cache_free(task_cache, position);
+        }
+        rhashtable_free_and_destroy(&cpu_data->tasks, free_hashed_entry, NULL);
+        
+        hash_for_each_safe(cpu_data->tgids, bkt, tmp, group, hash_list)
+            kmem_cache_free(group_cache, group);
+        hash_for_each_safe(cpu_data->cgroups, bkt, tmp, group, hash_list)
+            kmem_cache_free(group_cache, group);
+        kvfree(cpu_data->edges);
+        free_spares(cpu_data);
     }
+    free_percpu(perftop_cpus);
+    rcu_barrier();      /* Evicted and exited entries still waiting to be freed */
+    kmem_cache_destroy(group_cache);
+    kmem_cache_destroy(task_cache);
 }
 
+module_param_string(backend, backend, sizeof(backend), 0444);
+MODULE_PARM_DESC(backend, "tracepoint (sched_switch, default) or kretprobe (pick_next_task_fair)");
+module_param(ring_kb, int, 0444);
+MODULE_PARM_DESC(ring_kb, "Size of each CPU's /dev/perftop event ring in KB, 256 by default");
+module_param(max_tasks, int, 0444);
+MODULE_PARM_DESC(max_tasks, "Most task entries over all CPUs (one per task and CPU it ran on), the least recently run are evicted, 16384 by default");
+module_param(max_groups, int, 0444);
+MODULE_PARM_DESC(max_groups, "Most process and cgroup entries over all CPUs, the least recently charged are evicted, 4096 by default");
+module_param_string(funcs, funcs, sizeof(funcs), 0444);
+MODULE_PARM_DESC(funcs, "Comma separated kernel functions to profile the latency of, see /proc/perftop_funcs");
+module_param(sample_hz, int, 0444);
+MODULE_PARM_DESC(sample_hz, "Stack samples per second per CPU, 0 (default) for off");
+module_param(sample_every, int, 0444);
+MODULE_PARM_DESC(sample_every, "Account only 1 in this many switches per CPU, 1 (default) for all");
+module_param(offcpu, int, 0444);
+MODULE_PARM_DESC(offcpu, "1 to charge blocked time to kernel stacks, see /proc/perftop_offcpu, 0 (default) for off");
+module_param(wakegraph, int, 0444);
+MODULE_PARM_DESC(wakegraph, "1 to aggregate wakeups by waker and wakee, see /proc/perftop_wakeups, 0 (default) for off");
+module_param(locks, int, 0444);
+MODULE_PARM_DESC(locks, "1 to profile spinlock, mutex and rwsem contention, see /proc/perftop_locks, 0 (default) for off");
+
 module_init(perftop_init);
 module_exit(perftop_exit);
 
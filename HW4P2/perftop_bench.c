@@ -0,0 +1,305 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <errno.h>
+#include <unistd.h>
+#include <string.h>
+#include <stdint.h>
+#include <limits.h>
+#include <time.h>
+#include <sched.h>
+#include <pthread.h>
+#include <linux/futex.h>
+#include <sys/syscall.h>
+#include <sys/resource.h>
+
+#define errExit(str) do { \
+    perror(str); \
+    exit(EXIT_FAILURE); \
+} while(0)
+
+#define MAX_THREADS 256
+#define MAX_SAMPLES (1 << 20)   /* Latencies kept per thread */
+
+/*
+ * Context switch generator for measuring what perftop costs. Run it
+ * with the module unloaded and then loaded in each mode, see the
+ * benchmark target in the Makefile.
+ *
+ *   pipe   pairs of threads bouncing a byte over two pipes, latency is a round trip
+ *   futex  one thread waking all the others at once, latency is wake to running
+ *   ring   threads passing a token around, latency is one hop
+ *
+ * Threads are pinned round robin to the first -c CPUs we may run on,
+ * so -c 1 makes every handoff a switch on the same CPU.
+ */
+
+enum mode { MODE_PIPE, MODE_FUTEX, MODE_RING };
+
+struct worker {
+    pthread_t thread;
+    int id;
+    int fds[2];                 /* pipe: read end, write end */
+    uint64_t * samples;         /* Latencies in ns */
+    int nr_samples;
+    uint64_t ops;
+};
+
+static enum mode mode = MODE_PIPE;
+static int nr_threads = 2;
+static int nr_cpus = 1;         /* 0 leaves threads unpinned */
+static int seconds = 5;
+static int cpus[CPU_SETSIZE];    /* CPUs we may run on, in order */
+static volatile int stop;
+static struct worker workers[MAX_THREADS];
+
+/* futex mode */
+static uint32_t generation;     /* Bumped by the waker to release everyone */
+static uint32_t arrived;        /* Waiters done with the current generation */
+static uint64_t wake_ns;        /* When generation was bumped */
+
+/* ring mode */
+static uint32_t token;          /* id of the thread holding the token */
+static uint64_t pass_ns;        /* When the token was last passed */
+
+static uint64_t now_ns(void) {
+    struct timespec ts;
+    
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static long futex(uint32_t * uaddr, int op, uint32_t val) {
+    return syscall(SYS_futex, uaddr, op, val, NULL, NULL, 0);
+}
+
+static void add_sample(struct worker * w, uint64_t ns) {
+    if (w->nr_samples < MAX_SAMPLES)
+        w->samples[w->nr_samples++] = ns;
+    w->ops++;
+}
+
+static void pin(int id) {
+    cpu_set_t set;
+    
+    if (!nr_cpus)
+        return;
+    CPU_ZERO(&set);
+    CPU_SET(cpus[id % nr_cpus], &set);
+    if (sched_setaffinity(0, sizeof(set), &set) == -1)
+        errExit("sched_setaffinity failed");
+}
+
+/* Even ids start each round trip, odd ids echo back */
+static void * pipe_worker(void * arg) {
+    struct worker * w = arg;
+    struct worker * peer = &workers[w->id ^ 1];
+    char byte = 0;
+    uint64_t start;
+    
+    pin(w->id);
+    while (!stop) {
+        if (w->id & 1) {
+            if (read(w->fds[0], &byte, 1) != 1)
+                break;
+            if (write(peer->fds[1], &byte, 1) != 1)
+                break;
+            w->ops++;
+        }
+        else {
+            start = now_ns();
+            if (write(peer->fds[1], &byte, 1) != 1)
+                break;
+            if (read(w->fds[0], &byte, 1) != 1)
+                break;
+            add_sample(w, now_ns() - start);
+        }
+    }
+    /* Let the peer out of its read */
+    close(peer->fds[1]);
+    return NULL;
+}
+
+/* Thread 0 wakes everyone, the rest wait for it */
+static void * futex_worker(void * arg) {
+    struct worker * w = arg;
+    uint32_t seen = 0;
+    
+    pin(w->id);
+    while (!stop) {
+        if (!w->id) {
+            /* Start a storm, then wait for it to settle */
+            __atomic_store_n(&arrived, 0, __ATOMIC_RELAXED);
+            __atomic_store_n(&wake_ns, now_ns(), __ATOMIC_RELAXED);
+            __atomic_add_fetch(&generation, 1, __ATOMIC_RELEASE);
+            futex(&generation, FUTEX_WAKE_PRIVATE, INT_MAX);
+            w->ops++;
+            while (__atomic_load_n(&arrived, __ATOMIC_ACQUIRE) != (uint32_t)(nr_threads - 1) && !stop)
+                sched_yield();
+        }
+        else {
+            while (__atomic_load_n(&generation, __ATOMIC_ACQUIRE) == seen && !stop)
+                futex(&generation, FUTEX_WAIT_PRIVATE, seen);
+            if (stop)
+                break;
+            seen = __atomic_load_n(&generation, __ATOMIC_ACQUIRE);
+            add_sample(w, now_ns() - __atomic_load_n(&wake_ns, __ATOMIC_RELAXED));
+            __atomic_add_fetch(&arrived, 1, __ATOMIC_RELEASE);
+        }
+    }
+    /* Nobody is left to wake the waiters */
+    __atomic_add_fetch(&generation, 1, __ATOMIC_RELEASE);
+    futex(&generation, FUTEX_WAKE_PRIVATE, INT_MAX);
+    return NULL;
+}
+
+/* Wait for the token, hand it to the next thread */
+static void * ring_worker(void * arg) {
+    struct worker * w = arg;
+    uint32_t held;
+    
+    pin(w->id);
+    while (!stop) {
+        while ((held = __atomic_load_n(&token, __ATOMIC_ACQUIRE)) != (uint32_t)w->id && !stop)
+            futex(&token, FUTEX_WAIT_PRIVATE, held);
+        if (stop)
+            break;
+        add_sample(w, now_ns() - __atomic_load_n(&pass_ns, __ATOMIC_RELAXED));
+        
+        __atomic_store_n(&pass_ns, now_ns(), __ATOMIC_RELAXED);
+        __atomic_store_n(&token, (w->id + 1) % nr_threads, __ATOMIC_RELEASE);
+        futex(&token, FUTEX_WAKE_PRIVATE, INT_MAX);
+    }
+    /* Wake whoever is waiting for a token that won't come */
+    __atomic_store_n(&token, UINT32_MAX, __ATOMIC_RELEASE);
+    futex(&token, FUTEX_WAKE_PRIVATE, INT_MAX);
+    return NULL;
+}
+
+static int cmp_u64(const void * a, const void * b) {
+    uint64_t x = *(const uint64_t *)a, y = *(const uint64_t *)b;
+    
+    return x < y ? -1 : x > y;
+}
+
+static long switches(void) {
+    struct rusage usage;
+    
+    if (getrusage(RUSAGE_SELF, &usage) == -1)
+        errExit("getrusage failed");
+    return usage.ru_nvcsw + usage.ru_nivcsw;
+}
+
+int main(int argc, char ** argv) {
+    static const char * const mode_names[] = { "pipe", "futex", "ring" };
+    void * (*worker_fn)(void *);
+    uint64_t * all;
+    uint64_t start, elapsed, ops = 0;
+    long start_switches, total_switches;
+    size_t count = 0;
+    cpu_set_t allowed;
+    int nr_allowed = 0;
+    int opt, i;
+    
+    while ((opt = getopt(argc, argv, "m:t:c:d:")) != -1) {
+        switch (opt) {
+            case 'm':
+            for (i = 0; i < 3; i++) {
+                if (!strcmp(optarg, mode_names[i]))
+                    break;
+            }
+            if (i == 3) {
+                printf("Unknown mode %s\n", optarg);
+                exit(EXIT_FAILURE);
+            }
+            mode = i;
+            break;
+            
+            case 't':
+            nr_threads = atoi(optarg);
+            break;
+            
+            case 'c':
+            nr_cpus = atoi(optarg);
+            break;
+            
+            case 'd':
+            seconds = atoi(optarg);
+            break;
+            
+            default:
+            printf("Usage: %s [-m pipe|futex|ring] [-t threads] [-c cpus] [-d seconds]\n", argv[0]);
+            exit(EXIT_FAILURE);
+        }
+    }
+    
+    if (sched_getaffinity(0, sizeof(allowed), &allowed) == -1)
+        errExit("sched_getaffinity failed");
+    for (i = 0; i < CPU_SETSIZE; i++) {
+        if (CPU_ISSET(i, &allowed))
+            cpus[nr_allowed++] = i;
+    }
+    
+    if (nr_threads < 2 || nr_threads > MAX_THREADS || (mode == MODE_PIPE && nr_threads % 2) ||
+            nr_cpus < 0 || nr_cpus > nr_allowed || seconds < 1) {
+        printf("Need 2 to %d threads (an even number for pipe), 0 to %d cpus and seconds >= 1\n",
+                MAX_THREADS, nr_allowed);
+        exit(EXIT_FAILURE);
+    }
+    
+    worker_fn = mode == MODE_PIPE ? pipe_worker : mode == MODE_FUTEX ? futex_worker : ring_worker;
+    for (i = 0; i < nr_threads; i++) {
+        workers[i].id = i;
+        workers[i].samples = malloc(MAX_SAMPLES * sizeof(uint64_t));
+        if (!workers[i].samples)
+            errExit("malloc failed");
+        if (mode == MODE_PIPE && pipe(workers[i].fds) == -1)
+            errExit("pipe failed");
+    }
+    
+    start_switches = switches();
+    start = now_ns();
+    pass_ns = start;
+    for (i = 0; i < nr_threads; i++) {
+        if ((errno = pthread_create(&workers[i].thread, NULL, worker_fn, &workers[i])))
+            errExit("pthread_create failed");
+    }
+    
+    sleep(seconds);
+    stop = 1;
+    /* Get everyone out of their waits */
+    __atomic_add_fetch(&generation, 1, __ATOMIC_RELEASE);
+    futex(&generation, FUTEX_WAKE_PRIVATE, INT_MAX);
+    __atomic_store_n(&token, UINT32_MAX, __ATOMIC_RELEASE);
+    futex(&token, FUTEX_WAKE_PRIVATE, INT_MAX);
+    
+    for (i = 0; i < nr_threads; i++)
+        pthread_join(workers[i].thread, NULL);
+    elapsed = now_ns() - start;
+    total_switches = switches() - start_switches;
+    
+    /* Every thread's latencies sorted together */
+    for (i = 0; i < nr_threads; i++) {
+        count += workers[i].nr_samples;
+        ops += workers[i].ops;
+    }
+    all = malloc((count ? count : 1) * sizeof(uint64_t));
+    if (!all)
+        errExit("malloc failed");
+    count = 0;
+    for (i = 0; i < nr_threads; i++) {
+        memcpy(all + count, workers[i].samples, workers[i].nr_samples * sizeof(uint64_t));
+        count += workers[i].nr_samples;
+    }
+    qsort(all, count, sizeof(uint64_t), cmp_u64);
+    
+    printf("%s, %d threads on %d CPUs: %.0f switches/s, %.0f ops/s",
+            mode_names[mode], nr_threads, nr_cpus,
+            total_switches * 1e9 / elapsed, ops * 1e9 / elapsed);
+    if (count)
+        printf(", latency p50: %llu p99: %llu max: %llu ns",
+                (unsigned long long)all[count / 2], (unsigned long long)all[count * 99 / 100],
+                (unsigned long long)all[count - 1]);
+    printf("\n");
+    return 0;
+}
@@ -0,0 +1,119 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <errno.h>
+#include <unistd.h>
+#include <string.h>
+#include <stdint.h>
+#include <fcntl.h>
+#include <time.h>
+#include <sys/mman.h>
+#include "perftop_ring.h"
+
+#define errExit(str) do { \
+    perror(str); \
+    exit(EXIT_FAILURE); \
+} while(0)
+
+/*
+ * Example consumer of /dev/perftop. Maps every CPU's ring and drains
+ * them, printing each switch with -p or else once a second how many
+ * switches came in and how many the rings had to drop.
+ */
+
+static uint64_t now_ns(void) {
+    struct timespec ts;
+    
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+int main(int argc, char ** argv) {
+    struct perftop_ring_info * info;
+    struct perftop_ring_ctl * ctl;
+    struct perftop_event * events, * event;
+    char * area;
+    size_t size;
+    int fd, opt;
+    int print = 0;
+    uint64_t head, tail;
+    uint64_t drained = 0, lost = 0, last_lost = 0;
+    uint64_t last_report = now_ns();
+    
+    while ((opt = getopt(argc, argv, "p")) != -1) {
+        switch (opt) {
+            case 'p':
+            print = 1;
+            break;
+            
+            default:
+            printf("Usage: %s [-p]\n", argv[0]);
+            exit(EXIT_FAILURE);
+        }
+    }
+    
+    if ((fd = open(PERFTOP_RING_DEV, O_RDWR)) == -1)
+        errExit("Opening " PERFTOP_RING_DEV " failed");
+    
+    /* The info page tells us how big the whole thing is */
+    info = mmap(NULL, PERFTOP_RING_PAGE, PROT_READ, MAP_SHARED, fd, 0);
+    if (info == MAP_FAILED)
+        errExit("mmap failed");
+    if (info->magic != PERFTOP_RING_MAGIC || info->version != PERFTOP_RING_VERSION ||
+            info->event_size != sizeof(struct perftop_event)) {
+        printf("Unknown ring layout, rebuild against this perftop_ring.h\n");
+        exit(EXIT_FAILURE);
+    }
+    size = PERFTOP_RING_PAGE + info->nr_cpus * info->cpu_stride;
+    munmap(info, PERFTOP_RING_PAGE);
+    
+    area = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    if (area == MAP_FAILED)
+        errExit("mmap failed");
+    info = (struct perftop_ring_info *)area;
+    
+    for (;;) {
+        int idle = 1;
+        
+        for (unsigned int cpu = 0; cpu < info->nr_cpus; cpu++) {
+            ctl = (struct perftop_ring_ctl *)(area + PERFTOP_RING_PAGE + cpu * info->cpu_stride);
+            events = (struct perftop_event *)((char *)ctl + PERFTOP_RING_PAGE);
+            
+            head = __atomic_load_n(&ctl->head, __ATOMIC_ACQUIRE);
+            tail = ctl->tail;
+            if (head != tail)
+                idle = 0;
+            
+            for (; tail != head; tail++) {
+                event = &events[tail & (info->events_per_cpu - 1)];
+                if (print)
+                    printf("%llu cpu %u %d/%d -> %d/%d state %u\n",
+                            (unsigned long long)event->ts, event->cpu,
+                            event->prev_tgid, event->prev_pid,
+                            event->next_tgid, event->next_pid, event->prev_state);
+                drained++;
+            }
+            
+            /* Hands the slots back to the kernel */
+            __atomic_store_n(&ctl->tail, tail, __ATOMIC_RELEASE);
+        }
+        
+        if (!print && now_ns() - last_report >= 1000000000ULL) {
+            lost = 0;
+            for (unsigned int cpu = 0; cpu < info->nr_cpus; cpu++) {
+                ctl = (struct perftop_ring_ctl *)(area + PERFTOP_RING_PAGE + cpu * info->cpu_stride);
+                lost += __atomic_load_n(&ctl->lost, __ATOMIC_RELAXED);
+            }
+            printf("%llu switches/s, %llu lost\n", (unsigned long long)drained,
+                    (unsigned long long)(lost - last_lost));
+            fflush(stdout);
+            drained = 0;
+            last_lost = lost;
+            last_report = now_ns();
+        }
+        
+        /* Nothing came in on any CPU, don't spin */
+        if (idle)
+            usleep(1000);
+    }
+    return 0;
+}
@@ -0,0 +1,51 @@
+#ifndef PERFTOP_RING_H
+#define PERFTOP_RING_H
+
+#include <linux/types.h>
+
+/*
+ * Layout of /dev/perftop once mmap'ed (MAP_SHARED, read and write).
+ * The first page is a perftop_ring_info, then every CPU has cpu_stride
+ * bytes starting at PERFTOP_RING_PAGE + cpu * cpu_stride: one page of
+ * perftop_ring_ctl followed by events_per_cpu perftop_events.
+ *
+ * Every ring has a single producer, the scheduler on that CPU, and a
+ * single consumer. The kernel publishes events by advancing head; the
+ * consumer reads events [tail, head) at index & (events_per_cpu - 1)
+ * and then advances tail. Load head with acquire and store tail with
+ * release. Events that don't fit are counted in lost, nothing already
+ * in the ring is ever overwritten.
+ */
+#define PERFTOP_RING_DEV "/dev/perftop"
+#define PERFTOP_RING_MAGIC 0x50545247      /* "PTRG" */
+#define PERFTOP_RING_VERSION 1
+#define PERFTOP_RING_PAGE 4096              /* Size of the info and ctl pages */
+
+struct perftop_ring_info {
+    __u32 magic;            /* PERFTOP_RING_MAGIC */
+    __u32 version;          /* PERFTOP_RING_VERSION */
+    __u32 nr_cpus;          /* Rings that follow */
+    __u32 events_per_cpu;   /* Power of 2 */
+    __u32 event_size;       /* sizeof(struct perftop_event) */
+    __u32 pad;
+    __u64 cpu_stride;       /* Bytes from one CPU's ctl page to the next */
+};
+
+struct perftop_ring_ctl {
+    __u64 head;             /* Written by the kernel, events published so far */
+    __u64 tail;             /* Written by the consumer, events consumed so far */
+    __u64 lost;             /* Written by the kernel, events dropped because the ring was full */
+};
+
+/* One context switch */
+struct perftop_event {
+    __u64 ts;               /* CLOCK_MONOTONIC in ns */
+    __u32 cpu;
+    __u32 prev_state;       /* Task state prev was switched out in, 0 if still runnable */
+    __s32 prev_pid;
+    __s32 prev_tgid;
+    __s32 next_pid;
+    __s32 next_tgid;
+};
+
+#endif